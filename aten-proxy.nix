@@ -1,4 +1,4 @@
-{ stdenv, lib, libev, libvncserver, cmake, ninja, pkgconfig }:
+{ stdenv, lib, libev, libvncserver, gbenchmark, cmake, ninja, pkgconfig }:
 
 stdenv.mkDerivation {
   name = "aten-proxy";
@@ -7,7 +7,7 @@ stdenv.mkDerivation {
   src = lib.cleanSource ./.;
 
   nativeBuildInputs = [ cmake pkgconfig ninja ];
-  buildInputs = [ libev libvncserver ];
+  buildInputs = [ libev libvncserver gbenchmark ];
 
   installPhase = ''
     mkdir -p $out/bin
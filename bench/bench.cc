@@ -0,0 +1,19 @@
+// Microbenchmarks of the decoder, keymap and queues, registered with
+// google-benchmark in the other files here. Run with
+// --benchmark_format=json to compare runs with its tools.
+#include <benchmark/benchmark.h>
+
+#include "pixels.h"
+
+int main(int argc, char **argv) {
+	pixels_init();
+	benchmark::AddCustomContext("pixels_implementation",
+	                            pixels_implementation());
+
+	benchmark::Initialize(&argc, argv);
+	if (benchmark::ReportUnrecognizedArguments(argc, argv))
+		return 1;
+	benchmark::RunSpecifiedBenchmarks();
+	benchmark::Shutdown();
+	return 0;
+}
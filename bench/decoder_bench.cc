@@ -0,0 +1,103 @@
+#include <stdlib.h>
+
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "decoder.h"
+#include "pixels.h"
+
+static std::vector<char> randomBytes(size_t len) {
+	std::vector<char> data(len);
+	for (char& c : data)
+		c = rand();
+	return data;
+}
+
+// tiles of a subrect update covering every step'th tile of the screen
+static std::vector<char> makeTiles(int width, int height, int step,
+                                   size_t *count) {
+	const int tilesX = width / FrameDecoder::kTileSize;
+	const int tilesY = height / FrameDecoder::kTileSize;
+	std::vector<char> tiles;
+	*count = 0;
+	for (int i = 0; i < tilesX * tilesY; i += step) {
+		std::vector<char> tile = randomBytes(FrameDecoder::kTileLen);
+		tile[4] = i / tilesX;
+		tile[5] = i % tilesX;
+		tiles.insert(tiles.end(), tile.begin(), tile.end());
+		++*count;
+	}
+	return tiles;
+}
+
+// pixels
+static void copyPixels(benchmark::State& state) {
+	size_t count = state.range(0);
+	std::vector<char> in = randomBytes(2 * count);
+	std::vector<char> out(2 * count);
+	for (auto _ : state) {
+		pixels_copy(out.data(), in.data(), count);
+		benchmark::ClobberMemory();
+	}
+	state.SetBytesProcessed(state.iterations() * 2 * count);
+	state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(copyPixels)->Arg(256)->Arg(4096)->Arg(65536)->Arg(1280 * 1024);
+
+// a 1280x1024 screen with one tile in every step changed
+static void decodeTiles(benchmark::State& state) {
+	const int width = 1280, height = 1024;
+	size_t count;
+	std::vector<char> tiles = makeTiles(width, height, state.range(0), &count);
+	std::vector<char> fb(2 * width * height);
+	FrameDecoder decoder;
+	decoder.resize(width, height);
+	for (auto _ : state) {
+		// every tile is new, as if the screen changed
+		decoder.invalidate();
+		benchmark::DoNotOptimize(
+			decoder.decodeTiles(fb.data(), tiles.data(), count));
+	}
+	sraRgnDestroy(decoder.takeDirtyTiles());
+	state.SetBytesProcessed(state.iterations() * count * FrameDecoder::kTileLen);
+	state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(decodeTiles)->Arg(100)->Arg(10)->Arg(2)->Arg(1);
+
+// entire frames, width x height
+static void decodeFrameData(benchmark::State& state) {
+	size_t len = 2 * state.range(0) * state.range(1);
+	std::vector<char> data = randomBytes(len);
+	std::vector<char> fb(len);
+	FrameDecoder decoder;
+	decoder.resize(state.range(0), state.range(1));
+	for (auto _ : state) {
+		decoder.decodeFrameData(fb.data(), 0, data.data(), len);
+		benchmark::ClobberMemory();
+	}
+	state.SetBytesProcessed(state.iterations() * len);
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(decodeFrameData)
+	->Args({640, 480})->Args({1024, 768})
+	->Args({1280, 1024})->Args({1920, 1080});
+
+// merging the dirty tiles of an update into a region
+static void takeDirtyTiles(benchmark::State& state) {
+	const int width = 1280, height = 1024;
+	size_t count;
+	std::vector<char> tiles = makeTiles(width, height, state.range(0), &count);
+	std::vector<char> fb(2 * width * height);
+	FrameDecoder decoder;
+	decoder.resize(width, height);
+	for (auto _ : state) {
+		state.PauseTiming();
+		decoder.invalidate();
+		decoder.decodeTiles(fb.data(), tiles.data(), count);
+		state.ResumeTiming();
+		sraRgnDestroy(decoder.takeDirtyTiles());
+	}
+	state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(takeDirtyTiles)->Arg(100)->Arg(10)->Arg(3)->Arg(1);
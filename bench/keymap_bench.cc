@@ -0,0 +1,54 @@
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "keymap.h"
+#include "tests/keymap_old.h"
+
+// a press and release of each character of some typical text
+static std::vector<rfbKeySym> typedText() {
+	const char *text = "Hello, World! ssh root@10.0.0.1 -p 2222\n";
+	std::vector<rfbKeySym> keysyms;
+	for (const char *p = text; *p; p++)
+		keysyms.push_back(*p == '\n' ? XK_Return : rfbKeySym(*p));
+	return keysyms;
+}
+
+// the lookup alone, against the bsearch it replaced
+static void keymapLookupBsearch(benchmark::State& state) {
+	std::vector<rfbKeySym> keysyms = typedText();
+	keymap_old_init();
+	for (auto _ : state) {
+		for (rfbKeySym keysym : keysyms)
+			benchmark::DoNotOptimize(keymap_old_usageForKeysym(keysym));
+	}
+	state.SetItemsProcessed(state.iterations() * keysyms.size());
+}
+BENCHMARK(keymapLookupBsearch);
+
+static void keymapLookupPages(benchmark::State& state) {
+	std::vector<rfbKeySym> keysyms = typedText();
+	KeyMapper mapper;
+	for (auto _ : state) {
+		for (rfbKeySym keysym : keysyms)
+			benchmark::DoNotOptimize(mapper.usage(keysym));
+	}
+	state.SetItemsProcessed(state.iterations() * keysyms.size());
+}
+BENCHMARK(keymapLookupPages);
+
+static void keymapKeyEvent(benchmark::State& state) {
+	std::vector<rfbKeySym> keysyms = typedText();
+	KeyMapper mapper;
+	std::vector<KeyPress> presses;
+	for (auto _ : state) {
+		for (rfbKeySym keysym : keysyms) {
+			presses.clear();
+			mapper.keyEvent(keysym, true, presses);
+			mapper.keyEvent(keysym, false, presses);
+			benchmark::DoNotOptimize(presses.data());
+		}
+	}
+	state.SetItemsProcessed(state.iterations() * 2 * keysyms.size());
+}
+BENCHMARK(keymapKeyEvent);
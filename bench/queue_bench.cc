@@ -0,0 +1,108 @@
+#include <stdint.h>
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+
+#include <benchmark/benchmark.h>
+
+#include "spsc_ring.h"
+
+// about the size of a WriteAction or RFBUpdate
+struct Item {
+	uint64_t value;
+	char payload[40];
+};
+
+// the mutex, std::queue and condition variable the rings replaced
+class MutexQueue {
+	std::mutex mMutex;
+	std::condition_variable mCond;
+	std::queue<Item> mQueue;
+
+public:
+	void push(const Item& x) {
+		std::unique_lock<std::mutex> lock{mMutex};
+		mQueue.push(x);
+		mCond.notify_all();
+	}
+
+	Item pop() {
+		std::unique_lock<std::mutex> lock{mMutex};
+		while (mQueue.empty())
+			mCond.wait(lock);
+		Item x = mQueue.front();
+		mQueue.pop();
+		return x;
+	}
+};
+
+// Items handed from a producer thread to a consumer thread, one per
+// iteration.
+static void queueTransferMutex(benchmark::State& state) {
+	MutexQueue q;
+	uint64_t n = state.max_iterations;
+	std::thread producer([&q, n] {
+			Item x = Item();
+			for (x.value = 0; x.value < n; x.value++)
+				q.push(x);
+		});
+	uint64_t sum = 0;
+	for (auto _ : state)
+		sum += q.pop().value;
+	producer.join();
+	benchmark::DoNotOptimize(sum);
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(queueTransferMutex)->UseRealTime();
+
+static void queueTransferSPSC(benchmark::State& state) {
+	std::unique_ptr<SPSCRing<Item, 1024>> q(new SPSCRing<Item, 1024>);
+	uint64_t n = state.max_iterations;
+	SPSCRing<Item, 1024> *ring = q.get();
+	std::thread producer([ring, n] {
+			Item x = Item();
+			for (x.value = 0; x.value < n; x.value++) {
+				while (!ring->push(x))
+					std::this_thread::yield();
+			}
+		});
+	uint64_t sum = 0;
+	Item x;
+	for (auto _ : state) {
+		while (!ring->pop(x))
+			std::this_thread::yield();
+		sum += x.value;
+	}
+	producer.join();
+	benchmark::DoNotOptimize(sum);
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(queueTransferSPSC)->UseRealTime();
+
+// A push and a pop on one thread, the cost when the other side isn't
+// busy at the same time.
+static void queueUncontendedMutex(benchmark::State& state) {
+	MutexQueue q;
+	Item x = Item();
+	for (auto _ : state) {
+		q.push(x);
+		benchmark::DoNotOptimize(q.pop());
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(queueUncontendedMutex);
+
+static void queueUncontendedSPSC(benchmark::State& state) {
+	std::unique_ptr<SPSCRing<Item, 1024>> q(new SPSCRing<Item, 1024>);
+	Item x = Item();
+	for (auto _ : state) {
+		q->push(x);
+		q->pop(x);
+		benchmark::DoNotOptimize(x);
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(queueUncontendedSPSC);
@@ -0,0 +1,141 @@
+#include "capture.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#include <chrono>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+static int64_t monotonicNanos() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+CaptureWriter::CaptureWriter(const char *path) {
+	mFile = fopen(path, "wb");
+	if (!mFile)
+		throw std::runtime_error("cannot create capture file");
+	mSessionStart = 0;
+	mFailed = false;
+	if (fwrite(kCaptureMagic, sizeof(kCaptureMagic), 1, mFile) != 1) {
+		fclose(mFile);
+		throw std::runtime_error("capture write failed");
+	}
+}
+
+CaptureWriter::~CaptureWriter() {
+	fclose(mFile);
+}
+
+void CaptureWriter::beginSession() {
+	mSessionStart = monotonicNanos();
+}
+
+void CaptureWriter::write(const char *data, size_t len) {
+	if (mFailed)
+		return;
+	CaptureRecord r;
+	r.nanos = monotonicNanos() - mSessionStart;
+	r.len = len;
+	if (fwrite(&r, sizeof(r), 1, mFile) != 1 ||
+	    (len && fwrite(data, len, 1, mFile) != 1)) {
+		perror("capture write failed, recording stopped");
+		mFailed = true;
+	}
+}
+
+void CaptureWriter::endSession() {
+	write(nullptr, 0);
+	fflush(mFile);
+}
+
+// Waits for events on the socket or the timeout, dropping whatever
+// the proxy sends meanwhile. Returns false if the proxy went away.
+static bool waitSocket(int fd, short events, int timeoutMs) {
+	struct pollfd p = {fd, short(POLLIN | events), 0};
+	if (poll(&p, 1, timeoutMs) < 0)
+		return errno == EINTR;
+	if (p.revents & POLLIN) {
+		char sink[4096];
+		if (read(fd, sink, sizeof(sink)) == 0)
+			return false;
+	}
+	return !(p.revents & (POLLERR | POLLHUP));
+}
+
+static void feedCapture(FILE *file, int fd, bool realtime) {
+	std::vector<char> data;
+	int64_t start = monotonicNanos();
+	CaptureRecord r;
+	while (fread(&r, sizeof(r), 1, file) == 1 && r.len) {
+		data.resize(r.len);
+		if (fread(data.data(), r.len, 1, file) != 1) {
+			printf("replay: capture truncated\n");
+			break;
+		}
+
+		if (realtime) {
+			int64_t due = start + int64_t(r.nanos);
+			int64_t now;
+			// a socket that is writable would wake the wait
+			// straight away, so only wait for the proxy's input
+			while ((now = monotonicNanos()) < due) {
+				if (!waitSocket(fd, 0, (due - now) / 1000000 + 1))
+					goto done;
+			}
+		}
+
+		for (size_t sent = 0; sent < data.size(); ) {
+			ssize_t n = send(fd, data.data() + sent, data.size() - sent,
+			                 MSG_NOSIGNAL);
+			if (n > 0)
+				sent += n;
+			else if (n < 0 && errno != EAGAIN && errno != EINTR)
+				goto done;
+			else if (!waitSocket(fd, POLLOUT, -1))
+				goto done;
+		}
+	}
+done:
+	shutdown(fd, SHUT_WR);
+	// the proxy closes its end once it has seen the shutdown
+	struct pollfd p = {fd, POLLIN, 0};
+	char sink[4096];
+	while (poll(&p, 1, -1) >= 0 || errno == EINTR) {
+		ssize_t n = read(fd, sink, sizeof(sink));
+		if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+			break;
+	}
+	close(fd);
+	fclose(file);
+}
+
+unique_fd replayCapture(const char *path, bool realtime) {
+	FILE *file = fopen(path, "rb");
+	if (!file)
+		throw std::runtime_error("cannot open capture file");
+	char magic[sizeof(kCaptureMagic)];
+	if (fread(magic, sizeof(magic), 1, file) != 1 ||
+	    memcmp(magic, kCaptureMagic, sizeof(magic))) {
+		fclose(file);
+		throw std::runtime_error("not a capture file");
+	}
+
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		fclose(file);
+		throw std::runtime_error("socketpair failed");
+	}
+	for (int fd : fds)
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	std::thread(feedCapture, file, fds[1], realtime).detach();
+	return unique_fd(fds[0]);
+}
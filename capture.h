@@ -0,0 +1,44 @@
+// -*- c++ -*-
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "unique_fd.h"
+
+// A capture holds the bytes received from a BMC, as they were
+// received. The file starts with kCaptureMagic, followed by records of
+// a CaptureRecord header and its data. Each connection is a session,
+// ended by a record with no data.
+static const char kCaptureMagic[8] = {'A', 'T', 'E', 'N', 'C', 'A', 'P', '1'};
+
+struct CaptureRecord {
+	uint64_t nanos; // since the session started
+	uint32_t len;
+} __attribute__((packed));
+
+// Appends sessions to a capture file. Failing to create it is thrown
+// as std::runtime_error, later write errors end the recording.
+class CaptureWriter {
+	FILE *mFile;
+	int64_t mSessionStart;
+	bool mFailed;
+
+public:
+	explicit CaptureWriter(const char *path);
+	~CaptureWriter();
+
+	void beginSession();
+	void write(const char *data, size_t len);
+	void endSession();
+};
+
+// Plays the first session of a capture into a socket, from a thread of
+// its own, and returns the other end. Data the proxy sends is read and
+// dropped. In realtime mode records are spaced as they were received,
+// otherwise they are sent as fast as the socket takes them. The
+// socket is shut down at the end of the session.
+unique_fd replayCapture(const char *path, bool realtime);
+
+#endif /* _CAPTURE_H_ */
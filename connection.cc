@@ -1,5 +1,6 @@
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
 
 #include <arpa/inet.h>
 #include <sys/types.h>
@@ -18,7 +19,7 @@ getaddrinfo(const char *host, const char *service,
 	addrinfo *addressinfo;
 	int err = ::getaddrinfo(host, service, &hints, &addressinfo);
 	if (err) {
-		throw std::runtime_error("getaddrinfo failed");
+		throw std::runtime_error(gai_strerror(err));
 	}
 	return std::unique_ptr<addrinfo, AddrinfoDeleter>{addressinfo};
 }
@@ -39,78 +40,157 @@ const char *showAddress(const struct sockaddr *s) {
 	}
 }
 
-unique_fd connectSocket(const char *host, const char *service) {
+std::shared_ptr<const addrinfo> resolve(const char *host, const char *service) {
 	addrinfo hints;
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family = PF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
+	return getaddrinfo(host, service, hints);
+}
+
+}
+
+Connection::Connection(std::shared_ptr<const addrinfo> addresses)
+	: mAddresses(std::move(addresses))
+{
+	mAddress = mAddresses.get();
+	init();
+}
+
+Connection::Connection(unique_fd socket)
+	: mSocket(std::move(socket))
+{
+	mAddress = nullptr;
+	init();
+}
+
+void Connection::init() {
+	mConnecting = false;
+
+	mRecvBufferLen = kMinRecvBufferLen;
+	mRecvBuffer = (char*) malloc(mRecvBufferLen);
+	if (!mRecvBuffer)
+		abort();
+
+	mCursor = mRecvBuffer;
+	mDataLen = 0;
+	mWanted = 0;
+
+	mRecvFilled = false;
+	mRecvSmallFills = 0;
+
+	mSendOffset = 0;
+
+	memset(&mStats, 0, sizeof(mStats));
+	mCapture = nullptr;
+}
+
+bool Connection::connect() {
+	if (!mAddresses)
+		return true;
+
+	if (mConnecting) {
+		int error = 0;
+		socklen_t len = sizeof(error);
+		if (getsockopt(mSocket, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+			error = errno;
+		if (!error) {
+			mConnecting = false;
+			return true;
+		}
+		errno = error;
+		warn("connect to %s", NetworkUtils::showAddress(mAddress->ai_addr));
+		mAddress = mAddress->ai_next;
+	}
 
-	auto info = getaddrinfo(host, service, hints);
-	for (addrinfo *x = info.get(); x; x = x->ai_next) {
+	for (; mAddress; mAddress = mAddress->ai_next) {
+		const addrinfo *x = mAddress;
 		unique_fd s { socket(x->ai_family, x->ai_socktype, x->ai_protocol) };
 		if (s < 0) {
 			perror("socket");
 			continue;
 		}
+		fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
 
-		int err = connect(s, x->ai_addr, x->ai_addrlen);
-		if (err) {
-			warn("connect to %s", showAddress(x->ai_addr));
+		int err = ::connect(s, x->ai_addr, x->ai_addrlen);
+		if (err && errno != EINPROGRESS) {
+			warn("connect to %s", NetworkUtils::showAddress(x->ai_addr));
 			continue;
 		}
 
-		return s;
+		mSocket = std::move(s);
+		mConnecting = err != 0;
+		return !mConnecting;
 	}
 	throw std::runtime_error("connection failed");
 }
 
-}
-
-void Connection::writeBytes(const char *buf, size_t len) {
-	size_t off = 0;
-	while (off < len) {
-		ssize_t n = send(mSocket, buf + off, len - off, 0);
+bool Connection::flush() {
+	while (mSendOffset < mSendBuffer.size()) {
+		ssize_t n = send(mSocket, mSendBuffer.data() + mSendOffset,
+		                 mSendBuffer.size() - mSendOffset, MSG_NOSIGNAL);
+		mStats.sendCalls++;
 		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return false;
 			if (errno != EINTR) {
 				perror("send");
-				abort();
+				throw std::runtime_error("write failed");
 			}
 		}
 		else {
-			off += n;
+			mSendOffset += n;
+			mStats.sendBytes += n;
 		}
 	}
+	mSendBuffer.clear();
+	mSendOffset = 0;
+	return true;
 }
 
-char* Connection::readBytes(size_t len) {
-	if (mTempBufferLen < len) {
-		while (mTempBufferLen < len)
-			mTempBufferLen <<= 1;
-		mTempBuffer = reinterpret_cast<char*>(
-			realloc(mTempBuffer, mTempBufferLen));
-		if (!mTempBuffer)
-			abort();
-	}
-	return readBytes(mTempBuffer, len);
+void Connection::resizeRecvBuffer(size_t len) {
+	char *newBuffer = reinterpret_cast<char*>(malloc(len));
+	if (!newBuffer)
+		abort();
+	memcpy(newBuffer, mCursor, mDataLen);
+	free(mRecvBuffer);
+	mRecvBuffer = newBuffer;
+	mRecvBufferLen = len;
+	mCursor = mRecvBuffer;
+
+	mRecvFilled = false;
+	mRecvSmallFills = 0;
 }
 
-char *Connection::readBytes(char *buf, size_t len) {
-	size_t off = 0;
-
-	// take from buffer
-	if (mDataLen) {
-		size_t take = std::min(mDataLen, len);
-		memcpy(buf, mCursor, take);
+bool Connection::receive() {
+	size_t newLen = mRecvBufferLen;
+	if (mRecvFilled && newLen < kMaxRecvBufferLen) {
+		newLen <<= 1;
+	}
+	else if (mRecvSmallFills >= kShrinkAfterFills &&
+	         newLen > kMinRecvBufferLen) {
+		newLen >>= 1;
+	}
+	while (newLen < mWanted && newLen < kMaxRecvBufferLen)
+		newLen <<= 1;
+	mWanted = 0;
 
-		mDataLen -= take;
-		mCursor += take;
-		off += take;
+	if (newLen != mRecvBufferLen && newLen >= mDataLen) {
+		resizeRecvBuffer(newLen);
+	}
+	else if (mCursor != mRecvBuffer) {
+		// keep the unconsumed tail contiguous with what arrives next
+		memmove(mRecvBuffer, mCursor, mDataLen);
+		mCursor = mRecvBuffer;
 	}
 
-	// take from socket, ignoring buffer if > buffer size
-	while (len - off > mRecvBufferLen) {
-		ssize_t n = recv(mSocket, buf + off, len - off, 0);
+	size_t space = mRecvBufferLen - mDataLen;
+	while (true) {
+		ssize_t n = recv(mSocket, mRecvBuffer + mDataLen, space, 0);
+		mStats.recvCalls++;
 		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return false;
 			if (errno != EINTR) {
 				perror("recv");
 				throw std::runtime_error("read failed");
@@ -121,39 +201,17 @@ char *Connection::readBytes(char *buf, size_t len) {
 			throw std::runtime_error("remote host shut us down");
 		}
 		else {
-			off += n;
+			mStats.recvBytes += n;
+			if (mCapture)
+				mCapture->write(mRecvBuffer + mDataLen, n);
+			mDataLen += n;
+
+			mRecvFilled = size_t(n) == space;
+			if (size_t(n) < mRecvBufferLen / 4)
+				mRecvSmallFills++;
+			else
+				mRecvSmallFills = 0;
+			return true;
 		}
 	}
-
-	// take from socket to buffer, keeping leftovers in the buffer
-	if (len - off > 0) {
-		// buffer is empty, reset and fill buffer to at least len -
-		// off
-		mCursor = mRecvBuffer;
-		mDataLen = 0;
-		while (len - off > mDataLen) {
-			ssize_t n = recv(mSocket, mRecvBuffer + mDataLen, mRecvBufferLen - mDataLen, 0);
-			if (n < 0) {
-				if (errno != EINTR) {
-					perror("recv");
-					throw std::runtime_error("read failed");
-				}
-			}
-			else if (n == 0) {
-				// we got shut down
-				throw std::runtime_error("remote host shut us down");
-			}
-			else {
-				mDataLen += n;
-			}
-		}
-
-		size_t take = len - off;
-		memcpy(buf + off, mCursor, take);
-		mDataLen -= take;
-		mCursor += take;
-		off += take;
-	}
-
-	return buf;
 }
@@ -4,6 +4,8 @@
 
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <err.h>
 #include <stdio.h>
 
@@ -13,7 +15,13 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
 #include "unique_fd.h"
+#include "capture.h"
 
 namespace NetworkUtils {
 
@@ -26,18 +34,39 @@ struct AddrinfoDeleter {
 std::unique_ptr<addrinfo, AddrinfoDeleter>
 getaddrinfo(const char *host, const char *service, const addrinfo& hints);
 
-const char *showAddress(const struct sockaddr *s);
+// The stream addresses of host and service, for Connection. This
+// blocks on DNS, so is done before the event loops run.
+std::shared_ptr<const addrinfo> resolve(const char *host, const char *service);
 
-unique_fd connectSocket(const char *host, const char *service);
+const char *showAddress(const struct sockaddr *s);
 
 }
 
+// Non-blocking connection, driven by the caller's event loop. Errors
+// are thrown as std::runtime_error.
 class Connection {
-	unique_fd mSocket;
+public:
+	struct Stats {
+		uint64_t recvCalls;
+		uint64_t recvBytes;
+		uint64_t sendCalls;
+		uint64_t sendBytes;
+	};
+
+private:
+	// The receive buffer starts small and doubles whenever a recv
+	// fills it, up to kMaxRecvBufferLen, so bursts of tiles are taken
+	// from the socket in few syscalls. It halves again once recvs
+	// have stayed well below its size for a while.
+	static const size_t kMinRecvBufferLen = 16 * 1024;
+	static const size_t kMaxRecvBufferLen = 512 * 1024;
+	static const unsigned kShrinkAfterFills = 64;
+
+	std::shared_ptr<const addrinfo> mAddresses;
+	const addrinfo *mAddress; // being connected to
+	bool mConnecting;
 
-	// convenience buffer
-	char *mTempBuffer;
-	size_t mTempBufferLen;
+	unique_fd mSocket;
 
 	char *mRecvBuffer;
 	size_t mRecvBufferLen;
@@ -45,46 +74,94 @@ class Connection {
 	char *mCursor;
 	size_t mDataLen;
 
+	// the largest peek that could not be satisfied, the buffer is
+	// grown to fit it
+	size_t mWanted;
+
+	bool mRecvFilled;
+	unsigned mRecvSmallFills;
+
+	std::vector<char> mSendBuffer;
+	size_t mSendOffset;
+
+	Stats mStats;
+
+	// records what is received, if set
+	CaptureWriter *mCapture;
+
+	void init();
+	void resizeRecvBuffer(size_t len);
+
 public:
-	Connection(const char *host, const char *service)
-		: mSocket(NetworkUtils::connectSocket(host, service))
-	{
-		mTempBufferLen = 1024;
-		mTempBuffer = (char*) malloc(mTempBufferLen);
-		if (!mTempBuffer)
-			abort();
-
-		mRecvBufferLen = 1024;
-		mRecvBuffer = (char*) malloc(mRecvBufferLen);
-		if (!mRecvBuffer)
-			abort();
-
-		mCursor = mRecvBuffer;
-		mDataLen = 0;
-	}
+	// To one of addresses, from NetworkUtils::resolve. The connection
+	// is made by connect().
+	explicit Connection(std::shared_ptr<const addrinfo> addresses);
+	// Wraps a socket that is already connected.
+	explicit Connection(unique_fd socket);
 	~Connection() {
 		// TODO FIXME: better to be unique_ptr?
-		free(mTempBuffer);
 		free(mRecvBuffer);
 	}
 
-	void writeBytes(const char *buf, size_t len);
+	int fd() {
+		return mSocket;
+	}
+
+	// Tries each address of the host in turn. Returns true once
+	// connected, otherwise call again when the socket (which may have
+	// changed) becomes writable.
+	bool connect();
+
+	void setCapture(CaptureWriter *capture) {
+		mCapture = capture;
+	}
+
+	const Stats& stats() const {
+		return mStats;
+	}
+
+	// Receives what the socket has ready into the buffer. Returns
+	// false if there was nothing.
+	bool receive();
+
+	size_t buffered() const {
+		return mDataLen;
+	}
+
+	// Zero copy access to the receive buffer. peekBytes returns the
+	// next len bytes of the stream without consuming them, or nullptr
+	// if they have not all been received yet. The pointer is valid
+	// until the next receive or consumeBytes. len can't be more than
+	// the largest buffer.
+	const char* peekBytes(size_t len) {
+		if (len > kMaxRecvBufferLen)
+			throw std::runtime_error("message too long");
+		if (mDataLen < len) {
+			mWanted = std::max(mWanted, len);
+			return nullptr;
+		}
+		return mCursor;
+	}
+	void consumeBytes(size_t len) {
+		mCursor += len;
+		mDataLen -= len;
+	}
+
+	// Writes are queued, and sent by flush.
+	void writeBytes(const char *buf, size_t len) {
+		mSendBuffer.insert(mSendBuffer.end(), buf, buf + len);
+	}
 	void writeString(const char *buf) {
 		writeBytes(buf, strlen(buf));
 	}
-	char* readBytes(size_t len);
-	char* readBytes(char *buf, size_t len);
-
 	template <typename T>
 	void writeRaw(T x) {
 		writeBytes((char*) &x, sizeof(x));
 	}
-	template <typename T>
-	T readRaw() {
-		T x;
-		readBytes((char*) &x, sizeof(x));
-		return x;
-	}
+
+	// Sends as much of the queue as the socket takes, returns true
+	// when it is empty.
+	bool flush();
 };
 
 #endif /* _CONNECTION_H_ */
@@ -0,0 +1,180 @@
+#include <algorithm>
+
+#include "decoder.h"
+#include "pixels.h"
+
+DecodePool::DecodePool(int threads) {
+	mJob = nullptr;
+	mGeneration = 0;
+	mPending = 0;
+	mStopping = false;
+	for (int part = 1; part < threads; part++)
+		mThreads.emplace_back(&DecodePool::worker, this, part);
+}
+
+DecodePool::~DecodePool() {
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mStopping = true;
+	}
+	mStart.notify_all();
+	for (auto& t : mThreads)
+		t.join();
+}
+
+void DecodePool::run(const std::function<void(int, int)>& job) {
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mJob = &job;
+		mPending = mThreads.size();
+		mGeneration++;
+	}
+	mStart.notify_all();
+
+	job(0, parts());
+
+	std::unique_lock<std::mutex> lock(mMutex);
+	mDone.wait(lock, [this]{ return mPending == 0; });
+}
+
+void DecodePool::worker(int part) {
+	uint64_t seen = 0;
+	std::unique_lock<std::mutex> lock(mMutex);
+	while (true) {
+		mStart.wait(lock, [&]{ return mStopping || mGeneration != seen; });
+		if (mStopping)
+			return;
+		seen = mGeneration;
+		const std::function<void(int, int)>& job = *mJob;
+
+		lock.unlock();
+		job(part, parts());
+		lock.lock();
+
+		if (--mPending == 0)
+			mDone.notify_one();
+	}
+}
+
+FrameDecoder::FrameDecoder() {
+	mPool = nullptr;
+	mWidth = mHeight = 0;
+	mTilesX = mTilesY = 0;
+	mHaveDirtyTiles = false;
+}
+
+void FrameDecoder::resize(int width, int height) {
+	mWidth = width;
+	mHeight = height;
+	mTilesX = (width + kTileSize - 1) / kTileSize;
+	mTilesY = (height + kTileSize - 1) / kTileSize;
+	mDirtyTiles.assign(mTilesX * mTilesY, 0);
+	mTileHashes.assign(mTilesX * mTilesY, 0);
+	mHaveDirtyTiles = false;
+}
+
+void FrameDecoder::invalidate() {
+	std::fill(mTileHashes.begin(), mTileHashes.end(), 0);
+}
+
+size_t FrameDecoder::decodeTiles(char *fb, const char *tiles, size_t count) {
+	size_t decoded;
+	if (mPool && count >= kParallelTiles) {
+		std::vector<size_t> partDecoded(mPool->parts());
+		mPool->run([&](int part, int parts) {
+				partDecoded[part] = decodeTilesPart(fb, tiles, count, part, parts);
+			});
+		decoded = 0;
+		for (size_t n : partDecoded)
+			decoded += n;
+	}
+	else {
+		decoded = decodeTilesPart(fb, tiles, count, 0, 1);
+	}
+	if (decoded)
+		mHaveDirtyTiles = true;
+	return decoded;
+}
+
+size_t FrameDecoder::decodeTilesPart(char *fb, const char *tiles, size_t count,
+                                     int part, int parts) {
+	const int bsz = kTileSize;
+	size_t decoded = 0;
+
+	for (const char *tile = tiles; count--; tile += kTileLen) {
+		int y = uint8_t(tile[4]);
+		int x = uint8_t(tile[5]);
+		const char *data = tile + 6;
+		if (y % parts != part)
+			continue;
+
+		// Tiles are cut to the framebuffer, so a part only writes the
+		// rows of its own tiles.
+		if (x >= mTilesX || y >= mTilesY)
+			continue;
+		uint64_t hash = pixels_hash(data, 2 * bsz * bsz);
+		uint64_t& known = mTileHashes[y * mTilesX + x];
+		if (hash == known)
+			continue;
+		known = hash;
+		decoded++;
+
+		int width = std::min(bsz, mWidth - x * bsz);
+		int lines = std::min(bsz, mHeight - y * bsz);
+		char *out = fb + 2 * (y * bsz * mWidth + x * bsz);
+		for (int line = 0; line < lines; line++) {
+			pixels_copy(out, data, width);
+			out += 2 * mWidth;
+			data += 2 * bsz;
+		}
+
+		mDirtyTiles[y * mTilesX + x] = 1;
+	}
+	return decoded;
+}
+
+void FrameDecoder::decodeFrameData(char *fb, size_t offset,
+                                   const char *data, size_t len) {
+	size_t fbLen = 2 * mWidth * mHeight;
+	if (offset >= fbLen)
+		return;
+	size_t pixels = std::min(len, fbLen - offset) >> 1;
+	char *out = fb + offset;
+
+	if (mPool && 2 * pixels >= kParallelBytes) {
+		mPool->run([=](int part, int parts) {
+				size_t begin = pixels * part / parts;
+				size_t end = pixels * (part + 1) / parts;
+				pixels_copy(out + 2 * begin, data + 2 * begin, end - begin);
+			});
+	}
+	else {
+		pixels_copy(out, data, pixels);
+	}
+}
+
+sraRegionPtr FrameDecoder::takeDirtyTiles() {
+	sraRegionPtr region = sraRgnCreate();
+	for (int ty = 0; ty < mTilesY; ty++) {
+		uint8_t *row = &mDirtyTiles[ty * mTilesX];
+		int tx = 0;
+		while (tx < mTilesX) {
+			if (!row[tx]) {
+				tx++;
+				continue;
+			}
+			int start = tx;
+			while (tx < mTilesX && row[tx])
+				row[tx++] = 0;
+
+			sraRegionPtr run = sraRgnCreateRect(
+				start * kTileSize, ty * kTileSize,
+				std::min(tx * kTileSize, mWidth),
+				std::min((ty + 1) * kTileSize, mHeight));
+			sraRgnOr(region, run);
+			sraRgnDestroy(run);
+		}
+	}
+	mHaveDirtyTiles = false;
+	return region;
+}
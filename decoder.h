@@ -0,0 +1,106 @@
+// -*- c++ -*-
+#ifndef _DECODER_H_
+#define _DECODER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <rfb/rfbregion.h>
+
+// Threads that split large decodes between them. Jobs are run one at
+// a time, by one caller thread.
+class DecodePool {
+public:
+	// threads includes the caller's
+	explicit DecodePool(int threads);
+	~DecodePool();
+
+	int parts() const {
+		return mThreads.size() + 1;
+	}
+
+	// Runs job(part, parts) for each part, one on the calling thread
+	// and the rest on the workers, and returns once all are done.
+	void run(const std::function<void(int part, int parts)>& job);
+
+private:
+	void worker(int part);
+
+	std::vector<std::thread> mThreads;
+	std::mutex mMutex;
+	std::condition_variable mStart, mDone;
+	const std::function<void(int, int)> *mJob;
+	uint64_t mGeneration;
+	int mPending;
+	bool mStopping;
+};
+
+// Decodes the pixel data of ATEN frame updates into a framebuffer of
+// the screen's BGR555, and keeps track of the tiles that changed.
+// Parsing the stream around it is left to the caller, so it can be
+// driven from anywhere the update bytes are available.
+class FrameDecoder {
+public:
+	static const int kTileSize = 16;
+	// 4 unknown bytes, y, x, pixel data
+	static const size_t kTileLen = 6 + 2 * kTileSize * kTileSize;
+
+	// Decodes below these sizes stay on the calling thread, as handing
+	// them to a pool would cost more than it saves.
+	static const size_t kParallelTiles = 512;
+	static const size_t kParallelBytes = 256 * 1024;
+
+	FrameDecoder();
+
+	// Large decodes are split between the pool's threads, if set.
+	void setPool(DecodePool *pool) {
+		mPool = pool;
+	}
+
+	// For a framebuffer of the given size. All tiles become unknown.
+	void resize(int width, int height);
+
+	// Forgets the contents of all tiles, after the framebuffer was
+	// written by other means.
+	void invalidate();
+
+	// Decodes count consecutive tiles of a subrect update into fb.
+	// Returns how many were not skipped as unchanged.
+	size_t decodeTiles(char *fb, const char *tiles, size_t count);
+
+	// Copies len bytes of an entire frame update, starting at offset
+	// into it, clipped to the framebuffer. len must be even.
+	void decodeFrameData(char *fb, size_t offset, const char *data, size_t len);
+
+	bool haveDirtyTiles() const {
+		return mHaveDirtyTiles;
+	}
+
+	// Builds a region from the dirty tiles, merging horizontal runs,
+	// and clears them for the next update.
+	sraRegionPtr takeDirtyTiles();
+
+private:
+	// Decodes the tiles whose row falls to part, so that parts may
+	// run concurrently while repeats of a tile stay in stream order.
+	size_t decodeTilesPart(char *fb, const char *tiles, size_t count,
+	                       int part, int parts);
+
+	DecodePool *mPool;
+	int mWidth, mHeight;
+	int mTilesX, mTilesY;
+	std::vector<uint8_t> mDirtyTiles;
+	bool mHaveDirtyTiles;
+
+	// hash of the raw pixels last written to each tile, 0 if the
+	// tile's contents are unknown
+	std::vector<uint64_t> mTileHashes;
+};
+
+#endif /* _DECODER_H_ */
@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+
+#include "input.h"
+
+template <typename T>
+static void appendRaw(std::vector<char>& out, const T& x) {
+	const char *p = reinterpret_cast<const char*>(&x);
+	out.insert(out.end(), p, p + sizeof(x));
+}
+
+InputBatcher::InputBatcher(KeyMapper& keys, PasteTyper& paste)
+	: mKeys(keys), mPaste(paste)
+{
+	mDeadline = 0;
+	mResult = Result();
+	mExpired = 0;
+	reset();
+}
+
+void InputBatcher::begin(int64_t now) {
+	mBatch.clear();
+	mResult = Result();
+	mExpired = mDeadline ? now - mDeadline : 0;
+}
+
+void InputBatcher::add(const WriteAction& action) {
+	WriteAction ev = action;
+	bool stale = ev.timestamp < mExpired;
+
+	switch (ev.type) {
+	case WriteAction::Key: {
+		auto& p = ev.keyEvent;
+		if (stale && p.down) {
+			mResult.expired++;
+			break;
+		}
+		// keep the order of clicks and keys, as in shift-click
+		if (mPointerPending)
+			appendPointer();
+		mPresses.clear();
+		mKeys.keyEvent(p.keySym, p.down, mPresses);
+		appendKeyPresses(mBatch, mPresses);
+		if (!mPresses.empty()) {
+			if (!mResult.keyTime)
+				mResult.keyTime = ev.timestamp;
+			mResult.input = true;
+		}
+		break;
+	}
+
+	case WriteAction::Paste: {
+		std::string *text = ev.paste.text;
+		if (stale) {
+			mResult.expired++;
+		}
+		else if (!mPaste.add(*text)) {
+			printf("paste of %zu characters dropped, over %zu waiting\n",
+			       text->size(), PasteTyper::kMaxLen);
+		}
+		else {
+			printf("typing paste of %zu characters\n", text->size());
+			mResult.pasted = true;
+		}
+		delete text;
+		break;
+	}
+
+	case WriteAction::Pointer: {
+		auto& p = ev.pointerEvent;
+		if (stale) {
+			// only buttons being released still count
+			p.buttonMask &= mPointerButtons;
+			if (p.buttonMask == mPointerButtons) {
+				mResult.expired++;
+				break;
+			}
+		}
+		if (p.buttonMask != mPointerButtons) {
+			if (mPointerPending)
+				appendPointer();
+			mPendingPointer = p;
+			appendPointer();
+		}
+		else {
+			if (mPointerPending)
+				mResult.merged++;
+			mPendingPointer = p;
+			mPointerPending = true;
+		}
+		// the host draws the cursor
+		mResult.input = true;
+		break;
+	}
+	}
+}
+
+void InputBatcher::discard(const WriteAction& action) {
+	if (action.type == WriteAction::Paste)
+		delete action.paste.text;
+}
+
+void InputBatcher::releaseAll() {
+	mPresses.clear();
+	mKeys.releaseAll(mPresses);
+	appendKeyPresses(mBatch, mPresses);
+	if (mPointerPending || mPointerButtons) {
+		mPendingPointer.buttonMask = 0;
+		appendPointer();
+	}
+	mPaste.clear();
+}
+
+void InputBatcher::requestUpdate(uint8_t incremental) {
+	if (mUpdatePending) {
+		mPendingIncremental &= incremental;
+	}
+	else {
+		mPendingIncremental = incremental;
+		mUpdatePending = true;
+	}
+}
+
+const std::vector<char>& InputBatcher::finish(bool withUpdate) {
+	if (mPointerPending)
+		appendPointer();
+
+	if (mUpdatePending && withUpdate) {
+		// TODO FIXME: byte ordering of x, y, width and height
+		struct {
+			uint8_t messageType;
+			uint8_t incremental;
+			uint16_t x,y,width,height;
+		} req = {3, mPendingIncremental, 0, 0, 0, 0};
+		appendRaw(mBatch, req);
+		mUpdatePending = false;
+		mResult.updateRequested = true;
+	}
+	return mBatch;
+}
+
+void InputBatcher::reset() {
+	mKeys.reset();
+	mPointerPending = false;
+	mPendingPointer = {0, 0, 0};
+	mPointerButtons = 0;
+	mUpdatePending = false;
+	mPendingIncremental = 0;
+}
+
+void InputBatcher::appendPointer() {
+	struct {
+		uint8_t messageType;
+		uint8_t padding1;
+		uint8_t buttonMask;
+		uint16_t x;
+		uint16_t y;
+		char padding2[11];
+	} __attribute__((packed)) req;
+	memset(&req, 0, sizeof(req));
+	req.messageType = 5;
+	req.buttonMask = mPendingPointer.buttonMask;
+	req.x = htons(mPendingPointer.x);
+	req.y = htons(mPendingPointer.y);
+	appendRaw(mBatch, req);
+	mPointerButtons = mPendingPointer.buttonMask;
+	mPointerPending = false;
+}
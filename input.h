@@ -0,0 +1,137 @@
+// -*- c++ -*-
+#ifndef _INPUT_H_
+#define _INPUT_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "keymap.h"
+#include "paste.h"
+
+// Input from a VNC client, queued by the libev thread for the
+// upstream loop.
+struct WriteAction {
+	enum Type {
+		Key, Pointer, Paste
+	} type;
+	int64_t timestamp; // monotonic, when queued
+
+	union {
+		struct {
+			rfbBool down;
+			rfbKeySym keySym;
+		} keyEvent;
+		struct {
+			uint8_t buttonMask;
+			uint16_t x, y;
+		} pointerEvent;
+		struct {
+			std::string *text; // owned by the action
+		} paste;
+	};
+
+	template <Type type> struct setter;
+};
+
+template <> struct WriteAction::setter<WriteAction::Key> {
+	template <typename... Args> static void set(WriteAction& u, Args&& ...args) {
+		u.keyEvent = {args...};
+	}
+};
+template <> struct WriteAction::setter<WriteAction::Pointer> {
+	static void set(WriteAction& u, uint8_t buttonMask, uint16_t x, uint16_t y) {
+		u.pointerEvent = {buttonMask, x, y};
+	}
+};
+template <> struct WriteAction::setter<WriteAction::Paste> {
+	static void set(WriteAction& u, std::string *text) {
+		u.paste.text = text;
+	}
+};
+
+// Encodes the queued input into one batch of ATEN messages per send,
+// so bursts of keys don't become bursts of packets.
+//
+// Input older than the deadline is dropped rather than sent as a
+// burst of stale keystrokes, apart from releases of what is held.
+// Pointer motion is merged, so only the latest position is sent;
+// events that change the buttons are always sent, at their own
+// position, and so is any motion queued before a key event. Update
+// requests are merged into one and go after the input.
+class InputBatcher {
+public:
+	// what the last batch held
+	struct Result {
+		bool input; // changes the host's screen
+		int64_t keyTime; // the earliest key event sent, or 0
+		bool pasted; // text was handed to the paste typer
+		unsigned expired; // dropped for being older than the deadline
+		unsigned merged; // pointer motion replaced by later motion
+		bool updateRequested;
+	};
+
+	// Keys go through keys, pastes are handed to paste.
+	InputBatcher(KeyMapper& keys, PasteTyper& paste);
+
+	// nanoseconds, 0 for no limit
+	void setDeadline(int64_t deadline) {
+		mDeadline = deadline;
+	}
+
+	// Starts a batch of the input taken at now.
+	void begin(int64_t now);
+
+	// Encodes an action into the batch, or drops it. Takes the text of
+	// a paste.
+	void add(const WriteAction& action);
+
+	// Frees an action that isn't added.
+	static void discard(const WriteAction& action);
+
+	// After input was lost, releases every key and button held and
+	// stops the paste, so nothing stays down on the host.
+	void releaseAll();
+
+	// Requests are always for the whole screen, so several collapse
+	// into one that is only incremental if all of them were.
+	void requestUpdate(uint8_t incremental);
+
+	bool updatePending() const {
+		return mUpdatePending;
+	}
+
+	// Sends the merged pointer motion, and the update request if
+	// withUpdate. Returns the batch, valid until the next begin.
+	const std::vector<char>& finish(bool withUpdate);
+
+	const Result& result() const {
+		return mResult;
+	}
+
+	// Forgets what is held and pending, for a new session.
+	void reset();
+
+private:
+	void appendPointer();
+
+	KeyMapper& mKeys;
+	PasteTyper& mPaste;
+	int64_t mDeadline;
+
+	std::vector<char> mBatch;
+	Result mResult;
+	int64_t mExpired; // input queued before this is stale
+
+	bool mPointerPending;
+	decltype(WriteAction::pointerEvent) mPendingPointer;
+	uint8_t mPointerButtons; // of the last pointer event sent
+
+	bool mUpdatePending;
+	uint8_t mPendingIncremental;
+
+	std::vector<KeyPress> mPresses;
+};
+
+#endif /* _INPUT_H_ */
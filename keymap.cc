@@ -1,12 +1,24 @@
 #include <stdint.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
 #include <rfb/rfb.h>
 #include <rfb/keysym.h>
 #include "keymap.h"
 
-static struct keymap_t {
+struct keymap_t {
     rfbKeySym keysym;
     uint8_t hid;
-} keymap[] = {
+};
+
+static constexpr keymap_t keymap[] = {
     { XK_a, 0x04 },
     { XK_b, 0x05 },
     { XK_c, 0x06 },
@@ -61,58 +73,6 @@ static struct keymap_t {
     { XK_period, 0x37 },
     { XK_slash, 0x38 },
 
-    // this is a bit ugly. We have the result of os x applying our
-    // local keyboard layout, and we only have to combined key. We
-    // undo this mapping by picking an arbitrary layout that might
-    // have resulted in the input we see
-    { XK_less, 0x36 }, // ,
-    { XK_greater, 0x37 }, // .
-    { XK_exclam, 0x1e }, // 1
-    { XK_at, 0x1f }, // 2
-    { XK_numbersign, 0x20 }, // 3
-    { XK_dollar, 0x21 }, // 4
-    { XK_percent, 0x22 }, // 5
-    { XK_asciicircum, 0x23 }, // 6
-    { XK_ampersand, 0x24 }, // 7
-    { XK_asterisk, 0x25 }, // 8
-    { XK_parenleft, 0x26 }, // 9
-    { XK_parenright, 0x27 }, // 0
-    { XK_underscore, 0x2d }, // -
-    { XK_bar, 0x31 }, // backslash
-    { XK_quotedbl, 0x34 }, // '
-    { XK_asciitilde, 0x35 }, // `
-	{ XK_question, 0x38 },
-
-	{ XK_colon, 0x33 }, // ;
-
-    // and the alphabet
-    { XK_A, 0x04 },
-    { XK_B, 0x05 },
-    { XK_C, 0x06 },
-    { XK_D, 0x07 },
-    { XK_E, 0x08 },
-    { XK_F, 0x09 },
-    { XK_G, 0x0A },
-    { XK_H, 0x0B },
-    { XK_I, 0x0C },
-    { XK_J, 0x0D },
-    { XK_K, 0x0E },
-    { XK_L, 0x0F },
-    { XK_M, 0x10 },
-    { XK_N, 0x11 },
-    { XK_O, 0x12 },
-    { XK_P, 0x13 },
-    { XK_Q, 0x14 },
-    { XK_R, 0x15 },
-    { XK_S, 0x16 },
-    { XK_T, 0x17 },
-    { XK_U, 0x18 },
-    { XK_V, 0x19 },
-    { XK_W, 0x1A },
-    { XK_X, 0x1B },
-    { XK_Y, 0x1C },
-    { XK_Z, 0x1D },
-
     {XK_F1, 0x3a},
     {XK_F2, 0x3b},
     {XK_F3, 0x3c},
@@ -170,25 +130,289 @@ static struct keymap_t {
 	{XK_Alt_R, 0xE6},
 };
 
-static int compare_keysym(const void *lv, const void *rv) {
-    const struct keymap_t *left = (const struct keymap_t*) lv;
-    const struct keymap_t *right = (const struct keymap_t*) rv;
-    return left->keysym - right->keysym;
+// Keysyms typed with shift held on a US layout. The client sends
+// the keysym its own layout produced, such as XK_at for shift and 2,
+// and the key is pressed with whatever shift state that needs.
+static constexpr keymap_t shiftedKeymap[] = {
+    { XK_less, 0x36 }, // ,
+    { XK_greater, 0x37 }, // .
+    { XK_exclam, 0x1e }, // 1
+    { XK_at, 0x1f }, // 2
+    { XK_numbersign, 0x20 }, // 3
+    { XK_dollar, 0x21 }, // 4
+    { XK_percent, 0x22 }, // 5
+    { XK_asciicircum, 0x23 }, // 6
+    { XK_ampersand, 0x24 }, // 7
+    { XK_asterisk, 0x25 }, // 8
+    { XK_parenleft, 0x26 }, // 9
+    { XK_parenright, 0x27 }, // 0
+    { XK_underscore, 0x2d }, // -
+    { XK_bar, 0x31 }, // backslash
+    { XK_quotedbl, 0x34 }, // '
+    { XK_asciitilde, 0x35 }, // `
+	{ XK_question, 0x38 },
+
+	{ XK_colon, 0x33 }, // ;
+	{ XK_plus, 0x2e }, // =
+	{ XK_braceleft, 0x2f }, // [
+	{ XK_braceright, 0x30 }, // ]
+
+    { XK_A, 0x04 },
+    { XK_B, 0x05 },
+    { XK_C, 0x06 },
+    { XK_D, 0x07 },
+    { XK_E, 0x08 },
+    { XK_F, 0x09 },
+    { XK_G, 0x0A },
+    { XK_H, 0x0B },
+    { XK_I, 0x0C },
+    { XK_J, 0x0D },
+    { XK_K, 0x0E },
+    { XK_L, 0x0F },
+    { XK_M, 0x10 },
+    { XK_N, 0x11 },
+    { XK_O, 0x12 },
+    { XK_P, 0x13 },
+    { XK_Q, 0x14 },
+    { XK_R, 0x15 },
+    { XK_S, 0x16 },
+    { XK_T, 0x17 },
+    { XK_U, 0x18 },
+    { XK_V, 0x19 },
+    { XK_W, 0x1A },
+    { XK_X, 0x1B },
+    { XK_Y, 0x1C },
+    { XK_Z, 0x1D },
+};
+
+static constexpr size_t keymapLen = sizeof(keymap) / sizeof(*keymap);
+static constexpr size_t shiftedKeymapLen =
+    sizeof(shiftedKeymap) / sizeof(*shiftedKeymap);
+
+// The tables are expanded while compiling into direct lookup pages
+// for the two keysym ranges they use, Latin-1 (0x0000-0x00ff) and
+// function and modifier keys (0xff00-0xffff). Each page entry is the
+// usage, with the HID modifier bits it needs in the high byte.
+static constexpr rfbKeySym latin1Base = 0x0000;
+static constexpr rfbKeySym miscBase = 0xff00;
+static constexpr uint16_t shifted = 0x02 << 8; // left shift
+
+static constexpr uint16_t searchShifted(rfbKeySym c, size_t i = 0) {
+    return i == shiftedKeymapLen ? 0
+        : shiftedKeymap[i].keysym == c ? shiftedKeymap[i].hid | shifted
+        : searchShifted(c, i + 1);
+}
+
+static constexpr uint16_t searchKeymap(rfbKeySym c, size_t i = 0) {
+    return i == keymapLen ? searchShifted(c)
+        : keymap[i].keysym == c ? keymap[i].hid
+        : searchKeymap(c, i + 1);
+}
+
+static constexpr bool inPages(rfbKeySym c) {
+    return c - latin1Base < 0x100 || c - miscBase < 0x100;
+}
+
+static constexpr bool allInPages(const keymap_t *table, size_t len) {
+    return !len || (inPages(table->keysym) && allInPages(table + 1, len - 1));
+}
+
+static_assert(allInPages(keymap, keymapLen) &&
+              allInPages(shiftedKeymap, shiftedKeymapLen),
+              "keymap has a keysym outside the lookup pages");
+
+template <size_t... I> struct indices {};
+template <size_t N, size_t... I>
+struct make_indices : make_indices<N - 1, N - 1, I...> {};
+template <size_t... I>
+struct make_indices<0, I...> {
+    typedef indices<I...> type;
+};
+
+struct keymap_page {
+    uint16_t entry[0x100];
+};
+
+template <size_t... I>
+static constexpr keymap_page makePage(rfbKeySym base, indices<I...>) {
+    return keymap_page{{searchKeymap(base + I)...}};
+}
+
+static constexpr keymap_page latin1Page =
+    makePage(latin1Base, make_indices<0x100>::type());
+static constexpr keymap_page miscPage =
+    makePage(miscBase, make_indices<0x100>::type());
+
+KeyMapper::KeyMapper() {
+	for (int i = 0; i < 0x100; i++) {
+		mLatin1[i] = Entry{uint8_t(latin1Page.entry[i]),
+		                   uint8_t(latin1Page.entry[i] >> 8), true};
+		mMisc[i] = Entry{uint8_t(miscPage.entry[i]),
+		                 uint8_t(miscPage.entry[i] >> 8), false};
+	}
+	// space types the same at every level, so Shift+Space stays held
+	mLatin1[XK_space - latin1Base].level = false;
+	mAltGr = false;
+	mHeldModifiers = 0;
+}
+
+const KeyMapper::Entry *KeyMapper::lookup(rfbKeySym keysym) const {
+	if (keysym - latin1Base < 0x100)
+		return &mLatin1[keysym - latin1Base];
+	if (keysym - miscBase < 0x100)
+		return &mMisc[keysym - miscBase];
+	for (auto& other : mOther) {
+		if (other.first == keysym)
+			return &other.second;
+	}
+	return nullptr;
+}
+
+uint8_t KeyMapper::usage(rfbKeySym keysym) const {
+	const Entry *e = lookup(keysym);
+	return e ? e->usage : 0;
+}
+
+void KeyMapper::set(rfbKeySym keysym, Entry e) {
+	if (keysym - latin1Base < 0x100)
+		mLatin1[keysym - latin1Base] = e;
+	else if (keysym - miscBase < 0x100)
+		mMisc[keysym - miscBase] = e;
+	else {
+		for (auto& other : mOther) {
+			if (other.first == keysym) {
+				other.second = e;
+				return;
+			}
+		}
+		mOther.push_back(std::make_pair(keysym, e));
+	}
+}
+
+void KeyMapper::loadLayout(const char *path) {
+	std::ifstream in{path};
+	if (!in)
+		throw std::runtime_error(std::string("cannot open ") + path);
+
+	std::string line;
+	for (int lineno = 1; std::getline(in, line); lineno++) {
+		std::istringstream fields{line};
+		std::string keysym, usage, modifier;
+		if (!(fields >> keysym) || keysym[0] == '#')
+			continue;
+
+		Entry e = {0, 0, true};
+		rfbKeySym c;
+		char *end;
+		if (keysym.size() == 1) {
+			c = uint8_t(keysym[0]);
+		}
+		else {
+			c = strtoul(keysym.c_str(), &end, 0);
+			if (*end)
+				c = 0;
+		}
+		unsigned long u = 0;
+		if (fields >> usage)
+			u = strtoul(usage.c_str(), &end, 0);
+		if (!c || usage.empty() || *end || u > 0xff)
+			throw std::runtime_error(std::string(path) + ":" +
+			                         std::to_string(lineno) +
+			                         ": expected keysym and usage");
+		e.usage = u;
+
+		while (fields >> modifier) {
+			if (modifier == "shift")
+				e.modifiers |= kLeftShift;
+			else if (modifier == "altgr")
+				e.modifiers |= kRightAlt;
+			else
+				throw std::runtime_error(std::string(path) + ":" +
+				                         std::to_string(lineno) +
+				                         ": unknown modifier " + modifier);
+		}
+		if (e.modifiers & kRightAlt)
+			mAltGr = true;
+		set(c, e);
+	}
+}
+
+void KeyMapper::keyEvent(rfbKeySym keysym, bool down, std::vector<KeyPress>& out) {
+	auto pressed = std::find_if(mPressed.begin(), mPressed.end(),
+		[keysym](const std::pair<rfbKeySym, uint8_t>& p) {
+			return p.first == keysym;
+		});
+	if (!down) {
+		// Clients may report the release with the keysym of another
+		// level, if the modifier went up first, so fall back to the key.
+		if (pressed == mPressed.end()) {
+			const Entry *e = lookup(keysym);
+			if (!e || !e->usage)
+				return;
+			uint8_t usage = e->usage;
+			pressed = std::find_if(mPressed.begin(), mPressed.end(),
+				[usage](const std::pair<rfbKeySym, uint8_t>& p) {
+					return p.second == usage;
+				});
+			if (pressed == mPressed.end())
+				return;
+		}
+		uint8_t usage = pressed->second;
+		mPressed.erase(pressed);
+		if (usage >= 0xe0 && usage <= 0xe7)
+			mHeldModifiers &= ~(1 << (usage - 0xe0));
+		out.push_back(KeyPress{usage, false});
+		return;
+	}
+
+	const Entry *e = lookup(keysym);
+	if (!e || !e->usage)
+		return;
+	// a repeat while held is pressed again with the usage it got first
+	if (pressed == mPressed.end())
+		mPressed.push_back(std::make_pair(keysym, e->usage));
+
+	if (e->usage >= 0xe0 && e->usage <= 0xe7) {
+		mHeldModifiers |= 1 << (e->usage - 0xe0);
+		out.push_back(KeyPress{e->usage, true});
+		return;
+	}
+
+	if (!e->level) {
+		out.push_back(KeyPress{e->usage, true});
+		return;
+	}
+
+	// Bring shift and AltGr to what the keysym needs for the press,
+	// then back to what the client holds.
+	std::vector<KeyPress> toggles;
+	bool needShift = e->modifiers & kShift;
+	if (needShift && !(mHeldModifiers & kShift)) {
+		toggles.push_back(KeyPress{0xe1, true});
+	}
+	else if (!needShift) {
+		if (mHeldModifiers & kLeftShift)
+			toggles.push_back(KeyPress{0xe1, false});
+		if (mHeldModifiers & kRightShift)
+			toggles.push_back(KeyPress{0xe5, false});
+	}
+	bool needAltGr = e->modifiers & kRightAlt;
+	if (mAltGr && needAltGr != bool(mHeldModifiers & kRightAlt))
+		toggles.push_back(KeyPress{0xe6, needAltGr});
+
+	out.insert(out.end(), toggles.begin(), toggles.end());
+	out.push_back(KeyPress{e->usage, true});
+	for (auto it = toggles.rbegin(); it != toggles.rend(); ++it)
+		out.push_back(KeyPress{it->usage, !it->down});
 }
 
-void keymap_init() {
-    qsort(&keymap[0], sizeof(keymap) / sizeof(*keymap), sizeof(*keymap),
-          compare_keysym);
+void KeyMapper::releaseAll(std::vector<KeyPress>& out) {
+	for (auto& pressed : mPressed)
+		out.push_back(KeyPress{pressed.second, false});
+	reset();
 }
 
-uint8_t keymap_usageForKeysym(rfbKeySym c) {
-    const struct keymap_t *mapping = (struct keymap_t*)
-		bsearch(&c, &keymap[0], sizeof(keymap) / sizeof(*keymap), sizeof(*keymap),
-				compare_keysym);
-    if (mapping) {
-        return mapping->hid;
-    }
-    else {
-        return 0;
-    }
+void KeyMapper::reset() {
+	mPressed.clear();
+	mHeldModifiers = 0;
 }
@@ -1,9 +1,87 @@
 #ifndef KEYMAP_H
 #define KEYMAP_H
 
+#include <stdint.h>
+
+#include <utility>
+#include <vector>
+
+#include <rfb/rfb.h>
 #include <rfb/keysym.h>
 
-void keymap_init();
-uint8_t keymap_usageForKeysym(rfbKeySym c);
+// A HID key press or release, as sent to the iKVM.
+struct KeyPress {
+	uint8_t usage;
+	bool down;
+};
+
+// Turns VNC key events, which carry the keysym the client's layout
+// produced, into the HID key events that produce the same keysym on
+// the host's layout. The modifiers the client holds are tracked, so
+// shift and AltGr are only pressed or released around a key when the
+// keysym needs a different level than is held. Keys whose keysym
+// doesn't depend on the level, such as Space, Tab and the function
+// and arrow keys, are sent with the modifiers as held, and right Alt is
+// only taken for AltGr if the layout uses it.
+class KeyMapper {
+public:
+	// Starts with the built-in US layout.
+	KeyMapper();
+
+	// Loads a layout file, whose entries replace the built-in ones.
+	// Each line is
+	//   keysym usage [shift] [altgr]
+	// where keysym is a single character or a number such as 0x40,
+	// usage is the HID usage of the key, and shift and altgr are the
+	// modifiers needed to type the keysym with it. Blank lines and
+	// lines starting with # are ignored. Errors are thrown as
+	// std::runtime_error.
+	void loadLayout(const char *path);
+
+	// The HID usage of the key that types keysym, 0 if it is not in
+	// the layout.
+	uint8_t usage(rfbKeySym keysym) const;
+
+	// Appends the HID events for one VNC key event to out. Keysyms
+	// not in the layout are dropped.
+	void keyEvent(rfbKeySym keysym, bool down, std::vector<KeyPress>& out);
+
+	// Appends releases for every key still held down.
+	void releaseAll(std::vector<KeyPress>& out);
+
+	// Forgets held keys, when the iKVM session they were sent to is
+	// gone.
+	void reset();
+
+private:
+	// HID modifier bits, bit n for usage 0xe0 + n
+	enum {
+		kLeftShift = 0x02,
+		kRightShift = 0x20,
+		kRightAlt = 0x40, // AltGr, if the layout has it
+		kShift = kLeftShift | kRightShift,
+	};
+
+	struct Entry {
+		uint8_t usage; // 0 if unmapped
+		uint8_t modifiers; // kShift and/or kRightAlt needed
+		bool level; // false if typed whatever modifiers are held
+	};
+
+	const Entry *lookup(rfbKeySym keysym) const;
+	void set(rfbKeySym keysym, Entry e);
+
+	// direct lookup for Latin-1 and the 0xff00 function keys, which is
+	// nearly every keysym sent, and a list for the rest
+	Entry mLatin1[0x100];
+	Entry mMisc[0x100];
+	std::vector<std::pair<rfbKeySym, Entry>> mOther;
+
+	bool mAltGr; // some entry is typed with AltGr
+	uint8_t mHeldModifiers;
+	// usage sent for each keysym held down, so the release matches
+	// even if the modifiers changed meanwhile
+	std::vector<std::pair<rfbKeySym, uint8_t>> mPressed;
+};
 
 #endif
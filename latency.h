@@ -0,0 +1,62 @@
+// -*- c++ -*-
+#ifndef _LATENCY_H_
+#define _LATENCY_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+
+// Histogram of latencies with power of two buckets in microseconds.
+// Recorded from a single thread, and may be printed from any other.
+class LatencyHistogram {
+	// bucket i counts latencies below 2^i us
+	static const int kBuckets = 32;
+	std::atomic<uint64_t> mBuckets[kBuckets];
+
+public:
+	LatencyHistogram() {
+		for (int i = 0; i < kBuckets; i++)
+			mBuckets[i].store(0, std::memory_order_relaxed);
+	}
+
+	void record(int64_t nanos) {
+		uint64_t us = nanos > 0 ? nanos / 1000 : 0;
+		int bucket = us ? 64 - __builtin_clzll(us) : 0;
+		if (bucket >= kBuckets)
+			bucket = kBuckets - 1;
+		// only one writer, so no need for an atomic increment
+		std::atomic<uint64_t>& b = mBuckets[bucket];
+		b.store(b.load(std::memory_order_relaxed) + 1,
+		        std::memory_order_relaxed);
+	}
+
+	void print(const char *name) const {
+		uint64_t counts[kBuckets];
+		uint64_t total = 0;
+		for (int i = 0; i < kBuckets; i++) {
+			counts[i] = mBuckets[i].load(std::memory_order_relaxed);
+			total += counts[i];
+		}
+		if (!total) {
+			printf("  %-14s no samples\n", name);
+			return;
+		}
+
+		// upper bound of the bucket holding each percentile
+		const double percentiles[] = {0.5, 0.9, 0.99, 1.0};
+		unsigned long long bounds[4];
+		uint64_t seen = 0;
+		int p = 0;
+		for (int i = 0; i < kBuckets && p < 4; i++) {
+			seen += counts[i];
+			while (p < 4 && seen >= percentiles[p] * total)
+				bounds[p++] = 1ULL << i;
+		}
+		printf("  %-14s n=%llu p50<%lluus p90<%lluus p99<%lluus max<%lluus\n",
+		       name, (unsigned long long) total,
+		       bounds[0], bounds[1], bounds[2], bounds[3]);
+	}
+};
+
+#endif /* _LATENCY_H_ */
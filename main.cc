@@ -2,14 +2,20 @@
 #include <string.h>
 #include <err.h>
 
-#include <queue>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
 #include <thread>
-#include <mutex>
 #include <atomic>
-#include <condition_variable>
+#include <chrono>
 
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <signal.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
@@ -22,66 +28,48 @@
 
 #include "unique_fd.h"
 #include "connection.h"
+#include "spsc_ring.h"
+#include "capture.h"
+#include "decoder.h"
+#include "latency.h"
+#include "metrics.h"
 #include "keymap.h"
+#include "paste.h"
+#include "input.h"
+#include "pixels.h"
 
-struct rfb_event_check {
-	ev_check check;
-	rfbScreenInfoPtr rfb;
-};
-
-struct WriteAction {
-	enum Type {
-		Key, UpdateFramebuffer, Ping
-	} type;
-
-	union {
-		struct {
-			rfbBool down;
-			rfbKeySym keySym;
-		} keyEvent;
-		struct {
-			uint8_t incremental;
-			uint16_t x; uint16_t y;
-			uint16_t w; uint16_t h;
-		} updateFramebuffer;
-	};
-
-	template <Type type> struct setter;
-};
+class AtenServer;
 
-template <> struct WriteAction::setter<WriteAction::Key> {
-	template <typename... Args> static void set(WriteAction& u, Args&& ...args) {
-		u.keyEvent = {args...};
-	}
-};
-template <> struct WriteAction::setter<WriteAction::UpdateFramebuffer> {
-	static void set(WriteAction& u, uint8_t i, uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
-		u.updateFramebuffer = {i, x, y, w ,h};
-	}
-};
-template <> struct WriteAction::setter<WriteAction::Ping> {
-	static void set(WriteAction& u) {
-		(void) u;
-	}
+// libev watcher for one of libvncserver's sockets
+struct rfb_event_io {
+	ev_io io;
+	AtenServer *self;
 };
 
-
 struct RFBUpdate {
 	enum Type {
 		SetFramebuffer,
-		AddDirtyRect,
+		PublishFrame,
 		SetServerName,
 	} type;
+	int64_t timestamp; // monotonic, when queued
 	union {
 		struct {
-			char *newFramebuffer;
+			char *arena; // owned by the update if not the current one
+			size_t arenaLen;
+			char *front;
 			int width;
 			int height;
+			uint64_t frame;
 		} setFramebuffer;
 		struct {
-			int x1; int y1;
-			int x2; int y2;
-		} addDirtyRect;
+			char *buffer;
+			sraRegionPtr region; // owned by the update
+			uint64_t frame;
+			// the earliest key event sent before the frame was
+			// requested, or 0
+			int64_t inputTime;
+		} publishFrame;
 		struct {
 			const char *name;
 		} setServerName;
@@ -100,9 +88,9 @@ template <> struct RFBUpdate::setter<RFBUpdate::SetServerName> {
 		u.setServerName = {args...};
 	}
 };
-template <> struct RFBUpdate::setter<RFBUpdate::AddDirtyRect> {
+template <> struct RFBUpdate::setter<RFBUpdate::PublishFrame> {
 	template <typename... Args> static void set(RFBUpdate& u, Args&& ...args) {
-		u.addDirtyRect = {args...};
+		u.publishFrame = {args...};
 	}
 };
 
@@ -116,340 +104,1598 @@ E makeEvent(Args&& ...args) {
 	E::template setter<type>::set(e, std::forward<Args>(args)...);
 	return e;
 }
+// One BMC and the VNC port it is served on
+struct AtenTarget {
+	int vncPort; // 0 for libvncserver's default or command line
+	std::string host;
+	std::string port;
+	std::string username;
+	std::string password;
+	std::string recordPath; // capture of the BMC's stream, if not empty
+	// resolved once at startup, so reconnects don't block the upstream
+	// loop on DNS
+	std::shared_ptr<const addrinfo> addresses;
+};
+
 class AtenServer {
 public:
-	AtenServer(int *argc, char **argv);
-	void run();
+	// The VNC side runs on loop, the BMC connection on upstreamLoop,
+	// which may be shared with other servers.
+	AtenServer(struct ev_loop *loop, struct ev_loop *upstreamLoop,
+	           int *argc, char **argv, const AtenTarget& target);
 
-private:
-	WriteAction nextWriteAction();
+	// Registers with both event loops, which must not be running yet.
+	void start();
+
+	// Adds this server's samples to a scrape, on the libev thread.
+	void writeMetrics(MetricsText& out);
 
-	void doWriter();
-	void doReader();
+	// Splits large decodes between the pool's threads. Call before
+	// start.
+	void setDecodePool(DecodePool *pool) {
+		mDecoder.setPool(pool);
+	}
+
+private:
+	// Where the upstream parser is. The handshake and each message
+	// are consumed as they arrive, so a reply split across reads is
+	// resumed from here when the socket is next readable.
+	enum UpstreamState {
+		Disconnected,
+		Connecting,
+		ReadVersion,
+		ReadSecurityTypes,
+		ReadSecurityReply,
+		ReadAuthResult,
+		ReadServerInit,
+		ReadMessageType,
+		SkipMessage,
+		ReadFrameHeader,
+		ReadRectHeader,
+		ReadSubrectHeader,
+		ReadTile,
+		ReadFrameData,
+		SkipRectData,
+	};
+	// longest desktop name taken from the BMC's ServerInit
+	static const size_t kMaxServerNameLen = 1024;
+
+	void connectUpstream();
+	void upstreamConnected();
+	void closeUpstream();
+	void upstreamError(const char *reason);
+	void endReplay(const char *reason);
+
+	void upstreamReadable();
+	void upstreamWritable();
+	void upstreamSignal();
+	void upstreamDeadline();
+	void updateDeadline(bool activity);
+
+	bool parseUpstream();
+	void handleRectHeader(const char *rect);
+	void handleSubrectHeader(const char *sub);
+	void endRect();
+	void endFrameUpdate();
+
+	void scheduleUpdate();
+	void updateDue();
+	void updateTimeout();
+	void resetUpdateInterval();
+	void writeActions();
+	void discardInput();
+	void pasteTimeout();
+	void flushUpstream();
+	void upstreamSent();
+
+	void endMessage();
 
 	void keyEventHandler(rfbBool down, rfbKeySym keySym, rfbClientPtr cl);
+	void cutTextHandler(char *str, int len, rfbClientPtr cl);
+	void pointerEventHandler(int buttonMask, int x, int y, rfbClientPtr cl);
+	enum rfbNewClientAction newClientHandler(rfbClientPtr cl);
+	void clientGoneHandler(rfbClientPtr cl);
+
+	void watchRFBSocket(rfb_event_io *w, int fd);
+	void processRFBEvents();
+	void updateDemand();
+	void installTranslateFns();
 
-	void handleFrameUpdate();
 	void handleRFBUpdates();
 
+	void resizeBuffers(int width, int height);
+	bool rfbCaughtUp(bool backBuffer);
+	bool waitForRFB(bool backBuffer);
+	void rfbAcknowledged();
+	void acquireBackBuffer();
+	void publishFrame();
+	void markFrameModified(int x1, int y1, int x2, int y2);
+
 	void sendRFBUpdate(const RFBUpdate& u);
-	void sendAction(const WriteAction& w);
+	bool sendInputAction(const WriteAction& w);
+
+	void idleTimeout();
+	void printLatency();
 
 	// rfb side
 	rfbScreenInfoPtr mRFB;
-	char *mFrameBuffer;
 	int mFBWidth, mFBHeight;
 	bool mSetServerName;
 	bool mScreenOff;
 
-	// upstream side
+	// pixels and dirty tiles of frame updates, upstream loop only
+	FrameDecoder mDecoder;
+
+	// The framebuffer is triple buffered so clients never see a
+	// frame update half written. The upstream decodes into the back
+	// buffer, mFrameBuffer, and publishes it together with the
+	// region it changed when the update completes; the libev thread
+	// then points libvncserver at it. A buffer is reused once the
+	// libev thread has moved past it, after copying in only the
+	// regions published since it was last written.
+	//
+	// The buffers are fixed size slots in one arena, big enough for
+	// the largest mode seen, so changing modes doesn't allocate. The
+	// arena is only replaced when a larger mode turns up.
+	static const int kBuffers = 3;
+	static const size_t kMinSlotLen = 2 * 1024 * 768;
+	static const size_t kHugePageSize = 2 * 1024 * 1024;
+	char *mArena;
+	size_t mArenaLen;
+	size_t mSlotLen;
+	bool mNewArena; // not yet handed to the libev thread
+	bool mResized; // since the last published frame
+	char *mFrameBuffer;
+	bool mHaveBackBuffer;
+	sraRegionPtr mStale[kBuffers];
+	sraRegionPtr mFrameRegion; // changed by the current frame update
+	uint64_t mFramesPublished;
+	std::atomic<uint64_t> mFramesShown; // stored by the libev thread
+
+	// Set while the parser waits for the libev thread to show a frame
+	// or take updates off mRFBUpdates, see waitForRFB.
+	bool mRFBWait; // upstream loop only
+	std::atomic_bool mRFBAckWanted;
+	char *mShownArena; // libev thread only
+	size_t mShownArenaLen;
+
+	// upstream side, only touched from the upstream loop
+	AtenTarget mTarget;
 	std::unique_ptr<Connection> mConnection;
-
-	std::thread mReaderThread;
-	std::thread mWriterThread;
-
-	std::mutex mActionMutex;
-	std::condition_variable mActionCond;
-	std::queue<WriteAction> mActionQueue;
-
-	std::atomic_bool mTerminating;
+	UpstreamState mUpstreamState;
+
+	// keysyms to HID keys, tracking what the client holds
+	KeyMapper mKeyMapper;
+
+	// Text pasted by a client, typed in one batch every
+	// PasteTyper::kInterval. A paste is only typed when enabled, as
+	// clients send their clipboard whenever it changes.
+	bool mPaste;
+	PasteTyper mPasteTyper;
+
+	// input and update requests, encoded for the BMC
+	InputBatcher mInput;
+
+	// progress through the current frame update
+	int mRectsLeft;
+	int mSegmentsLeft;
+	size_t mDataLeft;
+	size_t mDataOffset;
+
+	// The BMC answers every update request straight away, changed or
+	// not, so requests are paced: at most one outstanding, at most
+	// one per mMinUpdateInterval, backing off up to
+	// kMaxUpdateInterval while the screen stays the same, and only
+	// sent while some client is waiting for an update (mDemand, set on
+	// the libev thread). Input returns to the fastest rate.
+	static constexpr double kMaxUpdateInterval = 0.5;
+	double mMinUpdateInterval;
+	double mUpdateInterval;
+	double mLastRequestTime;
+	bool mUpdateDue; // waiting for demand
+	std::atomic_bool mDemand;
+
+	// Deadlines for connecting, and for the rest of a handshake or
+	// message once it has started arriving. Between messages the BMC
+	// may stay quiet for as long as the screen does.
+	double mConnectTimeout;
+	double mReadTimeout;
+
+	// delay before reconnecting after an error, doubled on each
+	// failure up to kMaxBackoff
+	static constexpr double kMinBackoff = 1;
+	static constexpr double kMaxBackoff = 60;
+	double mBackoff;
+
+	// upstream syscalls per frame update, logged every
+	// mStatsInterval updates when enabled
+	unsigned mStatsInterval;
+	struct {
+		unsigned frames;
+		uint64_t recvCalls;
+		uint64_t recvBytes;
+		uint64_t tileHits;
+		uint64_t tileMisses;
+	} mFrameStats;
+	Connection::Stats mStatsBefore;
+	void logFrameStats(const Connection::Stats& before);
+
+	// Counters for the metrics endpoint, written by the upstream loop
+	// unless noted and summed up when scraped.
+	static const int kMessageTypes = 6;
+	struct {
+		Counter messages[kMessageTypes];
+		Counter messageBytes[kMessageTypes];
+		Counter tilesDecoded;
+		Counter tilesUnchanged;
+		Counter fullFrames;
+		Counter framesPublished;
+		Counter dirtyPixels;
+		Counter reconnects;
+		Counter inputDropped; // libev thread
+		Counter inputDiscarded;
+		Counter inputExpired;
+		Counter pointerMerged;
+	} mCounters;
+	// the message being received, as an index into kMessageTypeIds,
+	// and the stream offset it started at
+	int mMessageIndex;
+	uint64_t mMessageStart;
+
+	// Recording of what the BMC sends, and replay of such a recording
+	// in place of the BMC. A replay starts with the server and runs
+	// once, whether or not there are clients.
+	std::unique_ptr<CaptureWriter> mCapture;
+	std::string mReplayPath;
+	bool mReplayRealtime;
+	int64_t mReplayStart;
+	uint64_t mReplayFrames; // published before the replay started
+
+	// input from the libev thread, drained on the upstream loop. When
+	// it is full, mInputOverflow has the upstream loop drop the rest
+	// and release everything held.
+	SPSCRing<WriteAction, 1024> mInputActions;
+	std::atomic_bool mInputOverflow;
+	int64_t mInputDeadline; // nanoseconds, 0 for none
+
+	// Latency histograms, printed on SIGUSR1:
+	//   input queue   key event queued until taken by the upstream loop
+	//   send          batch encoded until written to the socket
+	//   decode        frame update from its first byte until complete
+	//   dispatch      RFBUpdate queued until handled by the libev thread
+	//   key to pixel  key event queued until the first frame after it
+	//                 was sent is marked modified
+	// The first three are recorded on the upstream loop, the others on
+	// the libev thread.
+	LatencyHistogram mInputQueueLatency;
+	LatencyHistogram mSendLatency;
+	LatencyHistogram mDecodeLatency;
+	LatencyHistogram mDispatchLatency;
+	LatencyHistogram mKeyToPixelLatency;
+	int64_t mSendStart; // oldest unsent batch, or 0
+	int64_t mFrameStart;
+	int64_t mUnsentKeyTime; // oldest key event not yet sent, or 0
+	int64_t mSentKeyTime; // oldest key event sent since the last frame, or 0
+
+	// The upstream is only connected while there are clients, and is
+	// dropped mIdleTimeout seconds after the last one leaves. In warm
+	// mode the session is kept and only update requests stop.
+	double mIdleTimeout;
+	bool mWarm;
+	int mClients; // libev thread only
+	std::atomic_bool mHaveClients;
+	bool mUpdatesPaused;
+	// when the first client arrived, for reporting time to first
+	// frame. 0 when not measuring.
+	std::atomic<int64_t> mFirstClientTime;
 
 	struct ev_loop *mEVLoop;
-	std::mutex mRFBMutex;
-	std::queue<RFBUpdate> mRFBUpdates;
+	static const size_t kRFBUpdates = 1024;
+	SPSCRing<RFBUpdate, kRFBUpdates> mRFBUpdates;
 	struct {
 		ev_async async;
 		AtenServer *self;
 	} mRFBSignal;
+
+	// libvncserver is driven by readiness of its sockets, plus a
+	// timer while it is deferring a framebuffer update
+	rfb_event_io mRFBListeners[4];
+	struct {
+		ev_timer timer;
+		AtenServer *self;
+	} mRFBDeferTimer;
+	struct {
+		ev_signal signal;
+		AtenServer *self;
+	} mLatencySignal;
+
+	struct ev_loop *mUpstreamLoop;
+	// wakes the upstream loop for queued input or a change in clients
+	struct {
+		ev_async async;
+		AtenServer *self;
+	} mUpstreamSignal;
+	// wakes the parser waiting for the libev thread
+	struct {
+		ev_async async;
+		AtenServer *self;
+	} mRFBAck;
+	struct {
+		ev_io io;
+		AtenServer *self;
+	} mUpstreamRead, mUpstreamWrite;
+	struct {
+		ev_timer timer;
+		AtenServer *self;
+	} mDeadlineTimer, mReconnectTimer, mIdleTimer, mUpdateTimer, mPasteTimer;
 };
 
-WriteAction AtenServer::nextWriteAction() {
-	std::unique_lock<std::mutex> lock{mActionMutex};
-	std::queue<WriteAction>& q = mActionQueue;
-	while (q.empty()) {
-		mActionCond.wait(lock);
+static int64_t monotonicNanos() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// After input was lost to a full queue, the rest of it is dropped too
+// and everything held is released, so no key or button stays down on
+// the host.
+void AtenServer::discardInput() {
+	unsigned dropped = 0;
+	WriteAction ev;
+	while (mInputActions.pop(ev)) {
+		InputBatcher::discard(ev);
+		dropped++;
+	}
+	printf("input queue overflowed, dropped %u more events and "
+	       "released all keys\n", dropped);
+	mCounters.inputDiscarded.add(dropped);
+
+	mInput.releaseAll();
+	ev_timer_stop(mUpstreamLoop, &mPasteTimer.timer);
+}
+
+// show the effect of input as soon as possible
+void AtenServer::resetUpdateInterval() {
+	if (mUpdateInterval != mMinUpdateInterval) {
+		mUpdateInterval = mMinUpdateInterval;
+		if (ev_is_active(&mUpdateTimer.timer))
+			scheduleUpdate();
 	}
-	WriteAction ev = q.front();
-	q.pop();
-	return ev;
 }
 
-void AtenServer::doWriter() {
-	// writer pulls from event queue and shoves out to upstream
-	// socket. TODO FIXME: very close to an unlimited size binary
-	// buffer, what, if anything, does this actually win us over
-	// something like sendAsync(char*)? Answers: drop expired key
-	// events, coalesce pointer events(possible with ikvm?), event
-	// boundaries for re-establishing connections (char**), event
-	// introspection on connection reset.
+// Input stays in the action queue while the BMC isn't taking what was
+// already sent, so the send queue holds at most one batch. Once it
+// drains, everything queued is encoded by mInput and sent with a
+// single send.
+void AtenServer::writeActions() {
+	if (mUpstreamState >= ReadMessageType && ev_is_active(&mUpstreamWrite.io))
+		return;
+
+	int64_t now = monotonicNanos();
+	mInput.begin(now);
+	if (mInputOverflow.exchange(false) && mUpstreamState >= ReadMessageType)
+		discardInput();
+
+	WriteAction ev;
+	while (mInputActions.pop(ev)) {
+		// input while the session is being set up is dropped
+		if (mUpstreamState < ReadMessageType) {
+			InputBatcher::discard(ev);
+			continue;
+		}
+		mInputQueueLatency.record(now - ev.timestamp);
+		mInput.add(ev);
+	}
 
+	const InputBatcher::Result& result = mInput.result();
+	// may request an update, which goes out with this batch
+	if (result.input)
+		resetUpdateInterval();
+	if (result.keyTime && !mUnsentKeyTime)
+		mUnsentKeyTime = result.keyTime;
+	if (result.pasted && !ev_is_active(&mPasteTimer.timer)) {
+		ev_timer_set(&mPasteTimer.timer, 0., PasteTyper::kInterval);
+		ev_timer_start(mUpstreamLoop, &mPasteTimer.timer);
+	}
+	mCounters.pointerMerged.add(result.merged);
+	if (result.expired) {
+		printf("dropped %u input events older than %.1f s\n",
+		       result.expired, mInputDeadline / 1e9);
+		mCounters.inputExpired.add(result.expired);
+	}
+
+	const std::vector<char>& batch =
+		mInput.finish(mUpstreamState >= ReadMessageType);
+	if (result.updateRequested)
+		mLastRequestTime = ev_now(mUpstreamLoop);
+
+	if (!batch.empty()) {
+		mConnection->writeBytes(batch.data(), batch.size());
+		if (!mSendStart)
+			mSendStart = now;
+	}
+}
+
+// Types the next batch of the paste.
+void AtenServer::pasteTimeout() {
+	// wait for the BMC to catch up
+	if (ev_is_active(&mUpstreamWrite.io))
+		return;
+
+	std::vector<char> batch;
+	mPasteTyper.typeBatch(mKeyMapper, batch);
+	if (!mPasteTyper.typing())
+		ev_timer_stop(mUpstreamLoop, &mPasteTimer.timer);
+
+	if (batch.empty())
+		return;
+	resetUpdateInterval();
 	try {
-		while (!mTerminating) {
-			WriteAction ev = nextWriteAction();
-			switch (ev.type) {
-			case WriteAction::Key: {
-				auto& p = ev.keyEvent;
-				struct {
-					uint8_t messageType;
-					uint8_t padding1;
-					uint8_t down;
-					char padding2[2];
-					uint32_t key;
-					char padding3[9];
-				} __attribute__((packed)) req;
-				memset(&req, 0, sizeof(req));
-				uint8_t usage = keymap_usageForKeysym(p.keySym);
-				// printf("key %s keysym=%x usage=%x\n",
-				// 	   p.down ? "down" : "up",
-				// 	   p.keySym, usage);
-				if (usage) {
-					req.messageType = 4;
-					req.down = p.down;
-					req.key = htonl(usage);
-					mConnection->writeBytes((char*) &req, sizeof(req));
-				}
-				break;
-			}
+		mConnection->writeBytes(batch.data(), batch.size());
+		if (!mSendStart)
+			mSendStart = monotonicNanos();
+		flushUpstream();
+	}
+	catch (const std::runtime_error& e) {
+		upstreamError(e.what());
+	}
+}
 
-			case WriteAction::UpdateFramebuffer: {
-				// TODO FIXME: byte ordering of x, y, width and height
-				auto& p = ev.updateFramebuffer;
-				struct {
-					uint8_t messageType;
-					uint8_t incremental;
-					uint16_t x,y,width,height;
-				} req = {3, p.incremental, p.x, p.y, p.w, p.h};
-				mConnection->writeBytes((char*) &req, sizeof(req));
-				break;
-			}
+// Sends what is queued, leaving the rest for when the socket is
+// writable again.
+void AtenServer::flushUpstream() {
+	if (mConnection->flush())
+		upstreamSent();
+	else
+		ev_io_start(mUpstreamLoop, &mUpstreamWrite.io);
+}
 
-			case WriteAction::Ping:
-				break;
-			}
-		}
+// after everything queued has been sent
+void AtenServer::upstreamSent() {
+	if (mSendStart) {
+		mSendLatency.record(monotonicNanos() - mSendStart);
+		mSendStart = 0;
+	}
+	if (mUnsentKeyTime) {
+		if (!mSentKeyTime)
+			mSentKeyTime = mUnsentKeyTime;
+		mUnsentKeyTime = 0;
+	}
+}
+
+
+static inline uint16_t readBE16(const char *p) {
+	uint16_t x;
+	memcpy(&x, p, sizeof(x));
+	return ntohs(x);
+}
+
+// upstream message types, in the order they are counted
+static const uint8_t kMessageTypeIds[] = {0, 4, 0x16, 0x37, 0x39, 0x3c};
+
+static inline uint32_t readBE32(const char *p) {
+	uint32_t x;
+	memcpy(&x, p, sizeof(x));
+	return ntohl(x);
+}
+
+void AtenServer::logFrameStats(const Connection::Stats& before) {
+	const Connection::Stats& after = mConnection->stats();
+	mFrameStats.frames++;
+	mFrameStats.recvCalls += after.recvCalls - before.recvCalls;
+	mFrameStats.recvBytes += after.recvBytes - before.recvBytes;
+
+	if (mFrameStats.frames < mStatsInterval)
+		return;
+
+	uint64_t tiles = mFrameStats.tileHits + mFrameStats.tileMisses;
+	printf("frame stats: %u updates, %.1f recv/update, %.0f bytes/update, "
+	       "%.1f%% of %llu tiles unchanged\n",
+	       mFrameStats.frames,
+	       double(mFrameStats.recvCalls) / mFrameStats.frames,
+	       double(mFrameStats.recvBytes) / mFrameStats.frames,
+	       tiles ? 100.0 * mFrameStats.tileHits / tiles : 0.0,
+	       (unsigned long long) tiles);
+	memset(&mFrameStats, 0, sizeof(mFrameStats));
+}
+
+// Anonymous memory for the framebuffer arena, huge page backed where
+// the kernel supports it.
+static char *mapArena(size_t len) {
+	void *p = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+	               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		abort();
+	}
+#ifdef MADV_HUGEPAGE
+	madvise(p, len, MADV_HUGEPAGE);
+#endif
+	return reinterpret_cast<char*>(p);
+}
+
+void AtenServer::resizeBuffers(int width, int height) {
+	size_t frameLen = 2 * width * height;
+	if (frameLen > mSlotLen) {
+		// an arena that was never published can't be in use
+		if (mNewArena)
+			munmap(mArena, mArenaLen);
+
+		mSlotLen = std::max(frameLen, size_t(kMinSlotLen));
+		mArenaLen = kBuffers * mSlotLen;
+		mArenaLen = (mArenaLen + kHugePageSize - 1) & ~(kHugePageSize - 1);
+		mArena = mapArena(mArenaLen);
+		mNewArena = true;
+	}
+	mResized = true;
+	mFBWidth = width;
+	mFBHeight = height;
+
+	// The back buffer was already free to write. It starts out
+	// blank, and the others are brought up to date from it as they
+	// are reused.
+	int back = mFramesPublished % kBuffers;
+	mFrameBuffer = mArena + back * mSlotLen;
+	memset(mFrameBuffer, 0, frameLen);
+
+	sraRegionPtr all = sraRgnCreateRect(0, 0, width, height);
+	for (int i = 0; i < kBuffers; i++) {
+		sraRgnMakeEmpty(mStale[i]);
+		if (i != back)
+			sraRgnOr(mStale[i], all);
+	}
+	sraRgnDestroy(all);
+	sraRgnMakeEmpty(mFrameRegion);
+
+	mHaveBackBuffer = true;
+}
+
+// Whether mRFBUpdates has room for another update and, if
+// backBuffer, the back buffer is free to write. The buffer was last
+// published kBuffers frames ago, and can be written once the libev
+// thread has shown one of the frames since, which it normally has
+// long before the next update arrives.
+bool AtenServer::rfbCaughtUp(bool backBuffer) {
+	if (mRFBUpdates.size() == kRFBUpdates)
+		return false;
+	return !backBuffer || mHaveBackBuffer ||
+		mFramesShown.load(std::memory_order_acquire) + kBuffers >=
+		mFramesPublished + 2;
+}
+
+// Returns true if the parser has to wait for the libev thread to catch
+// up. Reading stops until the libev thread acknowledges the updates
+// it handled, then the parser resumes where it stopped.
+bool AtenServer::waitForRFB(bool backBuffer) {
+	if (rfbCaughtUp(backBuffer))
+		return false;
+	mRFBAckWanted.store(true, std::memory_order_relaxed);
+	// pairs with the fence in handleRFBUpdates, so either the libev
+	// thread sees the flag or this sees what it handled
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (rfbCaughtUp(backBuffer))
+		return false;
+
+	mRFBWait = true;
+	ev_io_stop(mUpstreamLoop, &mUpstreamRead.io);
+	return true;
+}
+
+void AtenServer::rfbAcknowledged() {
+	if (!mRFBWait)
+		return;
+	mRFBWait = false;
+	try {
+		// what was received while waiting
+		while (parseUpstream())
+			;
 	}
 	catch (const std::runtime_error& e) {
-		printf("writer terminating due to %s\n", e.what());
-		mTerminating = true;
+		upstreamError(e.what());
+		return;
 	}
-	printf("writer exit\n");
+	if (mRFBWait)
+		return;
+	ev_io_start(mUpstreamLoop, &mUpstreamRead.io);
+	upstreamReadable();
 }
 
+// waitForRFB has made sure the back buffer is free
+void AtenServer::acquireBackBuffer() {
+	if (mHaveBackBuffer)
+		return;
+
+	// bring it up to date from the latest frame
+	uint64_t frame = mFramesPublished;
+	sraRegionPtr stale = mStale[frame % kBuffers];
+	char *back = mArena + (frame % kBuffers) * mSlotLen;
+	const char *latest = mArena + ((frame - 1) % kBuffers) * mSlotLen;
+
+	sraRectangleIterator *it = sraRgnGetIterator(stale);
+	sraRect r;
+	while (sraRgnIteratorNext(it, &r)) {
+		size_t offset = 2 * (r.y1 * mFBWidth + r.x1);
+		size_t len = 2 * (r.x2 - r.x1);
+		for (int y = r.y1; y < r.y2; y++) {
+			memcpy(back + offset, latest + offset, len);
+			offset += 2 * mFBWidth;
+		}
+	}
+	sraRgnReleaseIterator(it);
+	sraRgnMakeEmpty(stale);
 
-static void copyPixels(char *out, const char *in, size_t count) {
-	// TODO FIXME: potential bottleneck
-	while (count --> 0) {
-		const uint16_t ip = (in[0] & 0xff) | (in[1] << 8);
+	mFrameBuffer = back;
+	mHaveBackBuffer = true;
+}
 
-		uint8_t r = (ip >> 10) & 0x1f;
-		uint8_t g = (ip >> 5) & 0x1f;
-		uint8_t b = ip & 0x1f;
+static uint64_t regionArea(sraRegionPtr region) {
+	uint64_t area = 0;
+	sraRectangleIterator *it = sraRgnGetIterator(region);
+	sraRect r;
+	while (sraRgnIteratorNext(it, &r))
+		area += uint64_t(r.x2 - r.x1) * (r.y2 - r.y1);
+	sraRgnReleaseIterator(it);
+	return area;
+}
 
-		const uint16_t op = r | g << 5 | b << 10;
+void AtenServer::publishFrame() {
+	uint64_t frame = mFramesPublished++;
+	mCounters.framesPublished.add();
+	mCounters.dirtyPixels.add(mResized ? uint64_t(mFBWidth) * mFBHeight
+	                          : regionArea(mFrameRegion));
+	for (int i = 0; i < kBuffers; i++) {
+		if (i != int(frame % kBuffers))
+			sraRgnOr(mStale[i], mFrameRegion);
+	}
 
-		out[0] = op & 0xff;
-		out[1] = op >> 8;
-		out += 2;
-		in += 2;
+	if (mResized) {
+		// the whole screen is sent after a resize anyway
+		sendRFBUpdate(makeEvent<EV(RFBUpdate, SetFramebuffer)>(
+			mArena, mArenaLen, mFrameBuffer, mFBWidth, mFBHeight, frame));
+		mResized = false;
+		mNewArena = false;
+		sraRgnMakeEmpty(mFrameRegion);
 	}
+	else {
+		sendRFBUpdate(makeEvent<EV(RFBUpdate, PublishFrame)>(
+			mFrameBuffer, mFrameRegion, frame, mSentKeyTime));
+		mFrameRegion = sraRgnCreate();
+		mSentKeyTime = 0;
+	}
+	mHaveBackBuffer = false;
 }
 
-void AtenServer::handleFrameUpdate() {
-	char *fb = mFrameBuffer;
+void AtenServer::markFrameModified(int x1, int y1, int x2, int y2) {
+	sraRegionPtr rect = sraRgnCreateRect(x1, y1, x2, y2);
+	sraRgnOr(mFrameRegion, rect);
+	sraRgnDestroy(rect);
+}
 
-	mConnection->readBytes(1); // padding
+void AtenServer::handleRectHeader(const char *rect) {
+	// x, y, width, height, encoding, unknown, dataLen
+	int x = readBE16(rect);
+	int y = readBE16(rect + 2);
+	(void) x; (void) y;
+	int width = readBE16(rect + 4);
+	int height = readBE16(rect + 6);
+	int encoding = readBE32(rect + 8);
+	int unknown = readBE32(rect + 12);
+	(void) unknown;
+	(void) encoding;
+	int dataLen = readBE32(rect + 16);
+	(void) dataLen;
+	// printf("update[%d]: (%dx%d)+%d+%d len=%d\n",
+	//	   mRectsLeft, width, height, x, y, dataLen);
+
+	if (width == uint16_t(-640) && height == uint16_t(-480)) {
+		if (!mScreenOff) {
+			mScreenOff = true;
+			printf("screen disappeared, showing error\n");
+		}
+		// screen is disabled
+		memset(mFrameBuffer, 0xf0, mFBWidth * mFBHeight * 2);
+		mDecoder.invalidate();
+		markFrameModified(0, 0, mFBWidth, mFBHeight);
+		endRect();
+		return;
+	}
 
-	int nUpdates = ntohs(mConnection->readRaw<uint16_t>());
-	// printf("nUpdates=%i\n", nUpdates);
-	for (int update = 0; update < nUpdates; update++) {
-		int x = ntohs(mConnection->readRaw<uint16_t>());
-		int y = ntohs(mConnection->readRaw<uint16_t>());
-		(void) x; (void) y;
-		int width = ntohs(mConnection->readRaw<uint16_t>());
-		int height = ntohs(mConnection->readRaw<uint16_t>());
-		int encoding = ntohl(mConnection->readRaw<uint32_t>());
-		int unknown = ntohl(mConnection->readRaw<uint32_t>());
-		(void) unknown;
-		(void) encoding;
-		int dataLen = ntohl(mConnection->readRaw<uint32_t>());
-		(void) dataLen;
-		// printf("update[%d]: (%dx%d)+%d+%d len=%d\n",
-		//	   update, width, height, x, y, dataLen);
+	if (mScreenOff) {
+		printf("screen back again\n");
+		mScreenOff = false;
+	}
+	if (width != mFBWidth || height != mFBHeight) {
+		printf("framebuffer resizing!  %dx%d  -> %dx%d\n",
+			   mFBWidth, mFBHeight, width, height);
+		resizeBuffers(width, height);
+		mDecoder.resize(width, height);
+	}
+	mUpstreamState = ReadSubrectHeader;
+}
 
-		if (width == uint16_t(-640) && height == uint16_t(-480)) {
-			if (!mScreenOff) {
-				mScreenOff = true;
-				printf("screen disappeared, showing error\n");
-			}
-			// screen is disabled
-			memset(fb, 0xf0, mFBWidth * mFBHeight * 2);
-			sendRFBUpdate(makeEvent<EV(RFBUpdate, AddDirtyRect)>(0, 0, mFBWidth, mFBHeight));
+void AtenServer::handleSubrectHeader(const char *sub) {
+	// type, padding, segments, totalLen
+	int type = uint8_t(sub[0]);
+	int segments = readBE32(sub + 2);
+	int totalLen = readBE32(sub + 6);
+	if (totalLen < 10)
+		throw std::runtime_error("bad update length");
+
+	mDataLeft = totalLen - 10;
+	switch (type) {
+	case 0: // subrects
+		mSegmentsLeft = segments;
+		mUpstreamState = ReadTile;
+		break;
+	case 1: // entire frame
+		mDataOffset = 0;
+		mUpstreamState = ReadFrameData;
+		break;
+	default:
+		printf("Ignoring unknown update type: %x\n", type);
+		mUpstreamState = SkipRectData;
+		break;
+	}
+}
+
+void AtenServer::endRect() {
+	if (--mRectsLeft > 0)
+		mUpstreamState = ReadRectHeader;
+	else
+		endFrameUpdate();
+}
+
+void AtenServer::endMessage() {
+	mUpstreamState = ReadMessageType;
+	uint64_t offset = mConnection->stats().recvBytes - mConnection->buffered();
+	mCounters.messages[mMessageIndex].add();
+	mCounters.messageBytes[mMessageIndex].add(offset - mMessageStart);
+}
+
+void AtenServer::endFrameUpdate() {
+	endMessage();
+	mDecodeLatency.record(monotonicNanos() - mFrameStart);
+	bool changed = mResized || !sraRgnEmpty(mFrameRegion);
+	if (changed)
+		publishFrame();
+
+	int64_t firstClientTime = mFirstClientTime.exchange(0);
+	if (firstClientTime) {
+		printf("first frame %.1f ms after client connected\n",
+		       (monotonicNanos() - firstClientTime) / 1e6);
+	}
+	if (mStatsInterval) {
+		logFrameStats(mStatsBefore);
+		mStatsBefore = mConnection->stats();
+	}
+
+	if (changed) {
+		mUpdateInterval = mMinUpdateInterval;
+	}
+	else {
+		// without a limit, back off from 60 fps
+		mUpdateInterval = mUpdateInterval ? 2 * mUpdateInterval : 1 / 60.;
+		if (mUpdateInterval > kMaxUpdateInterval)
+			mUpdateInterval = kMaxUpdateInterval;
+	}
+	// when paused, the next request is sent on resume
+	if (!mUpdatesPaused)
+		scheduleUpdate();
+}
+
+// Sends the next update request once the current interval has passed
+// since the last.
+void AtenServer::scheduleUpdate() {
+	ev_timer_stop(mUpstreamLoop, &mUpdateTimer.timer);
+	double delay = mLastRequestTime + mUpdateInterval - ev_now(mUpstreamLoop);
+	if (delay <= 0) {
+		updateDue();
+		return;
+	}
+	ev_timer_set(&mUpdateTimer.timer, delay, 0.);
+	ev_timer_start(mUpstreamLoop, &mUpdateTimer.timer);
+}
+
+void AtenServer::updateDue() {
+	if (!mDemand || mUpdatesPaused) {
+		mUpdateDue = true;
+		return;
+	}
+	mUpdateDue = false;
+	mInput.requestUpdate(mScreenOff ? 0 /* full */ : 1 /* incrememntal */);
+}
+
+void AtenServer::updateTimeout() {
+	updateDue();
+	try {
+		writeActions();
+		flushUpstream();
+	}
+	catch (const std::runtime_error& e) {
+		upstreamError(e.what());
+	}
+}
+
+// Consumes as much of the buffered stream as possible, returns false
+// once it needs more.
+bool AtenServer::parseUpstream() {
+	const char *p;
+	switch (mUpstreamState) {
+	case Disconnected:
+	case Connecting:
+		return false;
+
+	case ReadVersion:
+		if (!(p = mConnection->peekBytes(strlen("RFB 003.008\n"))))
+			return false;
+		mConnection->consumeBytes(strlen("RFB 003.008\n"));
+		mConnection->writeString("RFB 003.008\n");
+
+		fprintf(stderr, "Completed handshake\n");
+		mUpstreamState = ReadSecurityTypes;
+		return true;
+
+	case ReadSecurityTypes: {
+		if (!(p = mConnection->peekBytes(1)))
+			return false;
+		int nSecurity = uint8_t(p[0]);
+		if (!(p = mConnection->peekBytes(1 + nSecurity)))
+			return false;
+		if (nSecurity < 1 || p[1] != 16)
+			throw std::runtime_error("unsupported security type");
+		mConnection->consumeBytes(1 + nSecurity);
+		mConnection->writeRaw<uint8_t>(16);
+		mUpstreamState = ReadSecurityReply;
+		return true;
+	}
+
+	case ReadSecurityReply: {
+		// unknown reply from aten, 24 bytes
+		if (!(p = mConnection->peekBytes(24)))
+			return false;
+		mConnection->consumeBytes(24);
+
+		fprintf(stderr, "Negotiated security type\n");
+
+		// auth
+		struct {
+			char username[24];
+			char password[24];
+		} auth;
+		strncpy(auth.username, mTarget.username.c_str(), sizeof(auth.username));
+		strncpy(auth.password, mTarget.password.c_str(), sizeof(auth.password));
+		mConnection->writeBytes((char*) &auth, sizeof(auth));
+		mUpstreamState = ReadAuthResult;
+		return true;
+	}
+
+	case ReadAuthResult:
+		if (!(p = mConnection->peekBytes(4)))
+			return false;
+		if (readBE32(p))
+			throw std::runtime_error("authentication failed");
+		mConnection->consumeBytes(4);
+
+		// client init
+		mConnection->writeRaw<uint8_t>(0);
+		mUpstreamState = ReadServerInit;
+		return true;
+
+	case ReadServerInit: {
+		// server init; aten sends complete garbaage
+		const size_t headerLen = sizeof(uint16_t) * 2 + 16; // dimensions
+		if (!(p = mConnection->peekBytes(headerLen + 4)))
+			return false;
+		size_t serverNameLen = readBE32(p + headerLen);
+		if (serverNameLen > kMaxServerNameLen)
+			throw std::runtime_error("server name too long");
+		// then 12 bytes of more aten unknown
+		size_t len = headerLen + 4 + serverNameLen + 12;
+		if (!(p = mConnection->peekBytes(len)))
+			return false;
+
+		if (waitForRFB(false))
+			return false;
+		RFBUpdate u;
+		u.type = RFBUpdate::SetServerName;
+		u.setServerName.name = strndup(p + headerLen + 4, serverNameLen);
+		sendRFBUpdate(u);
+		mConnection->consumeBytes(len);
+
+		// initial screen update
+		mInput.requestUpdate(0);
+		fprintf(stderr, "Sent request for initial update\n");
+
+		mBackoff = kMinBackoff;
+		mStatsBefore = mConnection->stats();
+		mUpstreamState = ReadMessageType;
+		return true;
+	}
+
+	case ReadMessageType: {
+		if (!(p = mConnection->peekBytes(1)))
+			return false;
+		int messageType = uint8_t(p[0]);
+		// printf("messagetype=%i\n", messageType);
+		switch (messageType) {
+		case 0:
+			mFrameStart = monotonicNanos();
+			mUpstreamState = ReadFrameHeader;
+			break;
+		case 4:
+			mDataLeft = 20;
+			break;
+		case 0x16:
+			mDataLeft = 1;
+			break;
+		case 0x37:
+			mDataLeft = 2;
+			break;
+		case 0x39:
+			mDataLeft = 264;
+			break;
+		case 0x3c:
+			mDataLeft = 8;
+			break;
+		default:
+			throw std::runtime_error("unknown message type");
 		}
-		else {
-			if (mScreenOff) {
-				printf("screen back again\n");
-				mScreenOff = false;
-			}
-			if (width != mFBWidth || height != mFBHeight) {
-				printf("framebuffer resizing!  %dx%d  -> %dx%d\n",
-					   mFBWidth, mFBHeight, width, height);
-				fb = mFrameBuffer =
-					reinterpret_cast<char*>(malloc(width * height * 2));
-				if (!fb) abort();
+		if (messageType != 0)
+			mUpstreamState = SkipMessage;
+		mMessageIndex = std::find(kMessageTypeIds, kMessageTypeIds + kMessageTypes,
+		                          messageType) - kMessageTypeIds;
+		mMessageStart = mConnection->stats().recvBytes - mConnection->buffered();
+		mConnection->consumeBytes(1);
+		return true;
+	}
 
-				mFBWidth = width;
-				mFBHeight = height;
+	case SkipMessage:
+	case SkipRectData: {
+		size_t take = std::min(mConnection->buffered(), mDataLeft);
+		mConnection->consumeBytes(take);
+		mDataLeft -= take;
+		if (mDataLeft)
+			return false;
+		if (mUpstreamState == SkipMessage)
+			endMessage();
+		else
+			endRect();
+		return true;
+	}
 
-				sendRFBUpdate(makeEvent<EV(RFBUpdate, SetFramebuffer)>(fb, width, height));
-			}
+	case ReadFrameHeader:
+		// padding, nUpdates
+		if (!(p = mConnection->peekBytes(3)))
+			return false;
+		// decoded into the back buffer, and published through
+		// mRFBUpdates once complete
+		if (waitForRFB(true))
+			return false;
+		mRectsLeft = readBE16(p + 1);
+		mConnection->consumeBytes(3);
+		acquireBackBuffer();
+		// printf("nUpdates=%i\n", mRectsLeft);
+		if (mRectsLeft)
+			mUpstreamState = ReadRectHeader;
+		else
+			endFrameUpdate();
+		return true;
+
+	case ReadRectHeader:
+		if (!(p = mConnection->peekBytes(20)))
+			return false;
+		handleRectHeader(p);
+		mConnection->consumeBytes(20);
+		return true;
+
+	case ReadSubrectHeader:
+		if (!(p = mConnection->peekBytes(10)))
+			return false;
+		handleSubrectHeader(p);
+		mConnection->consumeBytes(10);
+		return true;
+
+	case ReadTile: {
+		const size_t tileLen = FrameDecoder::kTileLen;
+		if (mSegmentsLeft) {
+			// all the tiles received so far, in one go
+			size_t count = std::min(size_t(mSegmentsLeft),
+			                        mConnection->buffered() / tileLen);
+			if (!(p = mConnection->peekBytes(std::max(count, size_t(1)) * tileLen)))
+				return false;
+			size_t decoded = mDecoder.decodeTiles(mFrameBuffer, p, count);
+			mFrameStats.tileMisses += decoded;
+			mFrameStats.tileHits += count - decoded;
+			mCounters.tilesDecoded.add(decoded);
+			mCounters.tilesUnchanged.add(count - decoded);
+			mConnection->consumeBytes(count * tileLen);
+			mSegmentsLeft -= count;
+			return true;
+		}
+		if (mDecoder.haveDirtyTiles()) {
+			sraRegionPtr tiles = mDecoder.takeDirtyTiles();
+			sraRgnOr(mFrameRegion, tiles);
+			sraRgnDestroy(tiles);
 		}
+		endRect();
+		return true;
+	}
 
-		if (!mScreenOff) {
-			int type = mConnection->readRaw<uint8_t>();
-			(void) mConnection->readBytes(1);
-			int segments = ntohl(mConnection->readRaw<uint32_t>());
-			int totalLen = ntohl(mConnection->readRaw<uint32_t>());
-			switch (type) {
-			case 0: // subrects
-				{
-					bool haveRect = false;
-					RFBUpdate u;
-					u.type = RFBUpdate::AddDirtyRect;
-
-					const int bsz = 16;
-					for (int s = 0; s < segments; s++) {
-						(void) mConnection->readBytes(4);
-						int y = mConnection->readRaw<uint8_t>();
-						int x = mConnection->readRaw<uint8_t>();
-						const char *data = mConnection->readBytes(2 * bsz * bsz);
-
-						char *out = fb + 2 * (y * bsz * mFBWidth + x * bsz);
-						char *end = fb + 2 * (mFBHeight * mFBWidth);
-						for (int line = 0; line < bsz; line++) {
-							int size = bsz * 2;
-							if (out > end)
-								break;
-							if (out + size > end)
-								size = end - out;
-							copyPixels(out, data, size >> 1);
-							out += 2 * mFBWidth;
-							data += size;
-						}
-
-						{
-							int x1 = x * bsz,
-								y1 = y * bsz,
-								x2 = (x + 1) * bsz,
-								y2 = (y + 1) * bsz;
-							if (!haveRect) {
-								u.addDirtyRect.x1 = x1;
-								u.addDirtyRect.y1 = y1;
-								u.addDirtyRect.x2 = x2;
-								u.addDirtyRect.y2 = y2;
-								haveRect = true;
-							}
-							else {
-								u.addDirtyRect.x1 = std::min(u.addDirtyRect.x1, x1);
-								u.addDirtyRect.y1 = std::min(u.addDirtyRect.y1, y1);
-								u.addDirtyRect.x2 = std::max(u.addDirtyRect.x2, x2);
-								u.addDirtyRect.y2 = std::max(u.addDirtyRect.y2, y2);
-							}
-						}
-					}
-					if (haveRect) {
-						// printf("subrect update merged to: %dx%d+%d+%d\n",
-						//	   u.addDirtyRect.x2 - u.addDirtyRect.x1,
-						//	   u.addDirtyRect.y2 - u.addDirtyRect.y1,
-						//	   u.addDirtyRect.x1,
-						//	   u.addDirtyRect.y1);
-						sendRFBUpdate(u);
-					}
-				}
-				break;
-			case 1:  // entire frame
-				{
-					const char *data = mConnection->readBytes(totalLen - 10);
-					copyPixels(fb, data, (totalLen - 10) >> 1);
-
-					sendRFBUpdate(makeEvent<EV(RFBUpdate, AddDirtyRect)>(0, 0, mFBWidth, mFBHeight));
-				}
-				break;
-			default:
-				printf("Ignoring unknown update type: %x\n", type);
-				(void) mConnection->readBytes(totalLen - 10);
-				break;
-			}
+	case ReadFrameData: {
+		// copied as it arrives, whole pixels at a time
+		size_t take = std::min(mConnection->buffered(), mDataLeft);
+		if (mDataLeft > 1)
+			take &= ~size_t(1);
+		if (!take && mDataLeft)
+			return false;
+
+		p = mConnection->peekBytes(take);
+		mDecoder.decodeFrameData(mFrameBuffer, mDataOffset, p, take);
+		mConnection->consumeBytes(take);
+		mDataOffset += take;
+		mDataLeft -= take;
+		if (mDataLeft)
+			return false;
+
+		mDecoder.invalidate();
+		markFrameModified(0, 0, mFBWidth, mFBHeight);
+		mCounters.fullFrames.add();
+		endRect();
+		return true;
+	}
+	}
+	return false;
+}
+
+void AtenServer::connectUpstream() {
+	try {
+		if (!mReplayPath.empty()) {
+			mReplayStart = monotonicNanos();
+			mReplayFrames = mCounters.framesPublished.get();
+			mConnection.reset(new Connection(replayCapture(
+				mReplayPath.c_str(), mReplayRealtime)));
 		}
+		else {
+			mConnection.reset(new Connection(mTarget.addresses));
+		}
+		if (mCapture) {
+			mCapture->beginSession();
+			mConnection->setCapture(mCapture.get());
+		}
+		mUpstreamState = Connecting;
+		ev_timer_set(&mDeadlineTimer.timer, mConnectTimeout, 0.);
+		ev_timer_start(mUpstreamLoop, &mDeadlineTimer.timer);
+		if (mConnection->connect()) {
+			upstreamConnected();
+		}
+		else {
+			ev_io_set(&mUpstreamWrite.io, mConnection->fd(), EV_WRITE);
+			ev_io_start(mUpstreamLoop, &mUpstreamWrite.io);
+		}
+	}
+	catch (const std::runtime_error& e) {
+		upstreamError(e.what());
+	}
+}
+
+void AtenServer::upstreamConnected() {
+	fprintf(stderr, "Connected to %s\n", mTarget.host.c_str());
+
+	ev_io_stop(mUpstreamLoop, &mUpstreamWrite.io);
+	ev_io_set(&mUpstreamWrite.io, mConnection->fd(), EV_WRITE);
+	ev_io_set(&mUpstreamRead.io, mConnection->fd(), EV_READ);
+	ev_io_start(mUpstreamLoop, &mUpstreamRead.io);
+
+	mUpstreamState = ReadVersion;
+	ev_timer_stop(mUpstreamLoop, &mDeadlineTimer.timer);
+	updateDeadline(true);
+}
+
+void AtenServer::closeUpstream() {
+	ev_io_stop(mUpstreamLoop, &mUpstreamRead.io);
+	ev_io_stop(mUpstreamLoop, &mUpstreamWrite.io);
+	ev_timer_stop(mUpstreamLoop, &mDeadlineTimer.timer);
+	ev_timer_stop(mUpstreamLoop, &mIdleTimer.timer);
+	ev_timer_stop(mUpstreamLoop, &mUpdateTimer.timer);
+	if (mCapture && mConnection)
+		mCapture->endSession();
+	mConnection = nullptr;
+	mUpstreamState = Disconnected;
+	mRFBWait = false;
+	mUpdatesPaused = false;
+	mUpdateDue = false;
+	mInput.reset();
+	ev_timer_stop(mUpstreamLoop, &mPasteTimer.timer);
+	mPasteTyper.clear();
+	mUpdateInterval = mMinUpdateInterval;
+	mSendStart = 0;
+	mUnsentKeyTime = 0;
+	mSentKeyTime = 0;
+}
+
+void AtenServer::upstreamError(const char *reason) {
+	if (!mReplayPath.empty()) {
+		endReplay(reason);
+		return;
+	}
+
+	printf("connection error: %s\n", reason);
+	closeUpstream();
+
+	if (mHaveClients) {
+		printf("reconnecting in %.0f seconds\n", mBackoff);
+		mCounters.reconnects.add();
+		ev_timer_set(&mReconnectTimer.timer, mBackoff, 0.);
+		ev_timer_start(mUpstreamLoop, &mReconnectTimer.timer);
+		mBackoff *= 2;
+		if (mBackoff > kMaxBackoff)
+			mBackoff = kMaxBackoff;
+	}
+}
+
+// servers whose replay has not finished yet
+static std::atomic<int> replaysRunning{0};
+// sent to the VNC and upstream loops when the last replay ends, so
+// that main returns
+static ev_async stopLoop, stopUpstreamLoop;
+
+void AtenServer::endReplay(const char *reason) {
+	double secs = (monotonicNanos() - mReplayStart) / 1e9;
+	uint64_t frames = mCounters.framesPublished.get() - mReplayFrames;
+	double mb = mConnection ? mConnection->stats().recvBytes / 1e6 : 0;
+	printf("replay of %s ended (%s): %llu frames, %.1f MB in %.3f s, "
+	       "%.1f frames/s, %.1f MB/s\n",
+	       mReplayPath.c_str(), reason, (unsigned long long) frames, mb, secs,
+	       frames / secs, mb / secs);
+	fflush(stdout);
+	closeUpstream();
+
+	// a benchmark run is over, unless someone is watching
+	if (--replaysRunning == 0 && !mHaveClients) {
+		ev_async_send(mEVLoop, &stopLoop);
+		ev_async_send(mUpstreamLoop, &stopUpstreamLoop);
 	}
-	sendAction(
-		makeEvent<EV(WriteAction, UpdateFramebuffer)>(
-			mScreenOff ? 0 /* full */ : 1 /* incrememntal */,
-			0, 0, 0, 0));
 }
 
-void AtenServer::doReader() {
+void AtenServer::upstreamReadable() {
 	try {
-		while (!mTerminating) {
-			int messageType = mConnection->readRaw<uint8_t>();
-			// printf("messagetype=%i\n", messageType);
-			switch (messageType) {
-			case 0:
-				handleFrameUpdate();
-				break;
-			case 4:
-				(void) mConnection->readBytes(20);
-				break;
-			case 0x16:
-				(void) mConnection->readBytes(1);
-				break;
-			case 0x37:
-				(void) mConnection->readBytes(2);
-				break;
-			case 0x39:
-				(void) mConnection->readBytes(264);
-				break;
-			case 0x3c:
-				(void) mConnection->readBytes(8);
-				break;
-			default:
-				abort();
+		bool received = false;
+		while (!mRFBWait && mConnection->receive()) {
+			received = true;
+			while (parseUpstream())
+				;
+		}
+		writeActions();
+		flushUpstream();
+		updateDeadline(received);
+	}
+	catch (const std::runtime_error& e) {
+		upstreamError(e.what());
+	}
+}
+
+void AtenServer::upstreamWritable() {
+	try {
+		if (mUpstreamState == Connecting) {
+			if (mConnection->connect()) {
+				upstreamConnected();
+			}
+			else {
+				// moved on to the next address
+				ev_io_stop(mUpstreamLoop, &mUpstreamWrite.io);
+				ev_io_set(&mUpstreamWrite.io, mConnection->fd(), EV_WRITE);
+				ev_io_start(mUpstreamLoop, &mUpstreamWrite.io);
 			}
 		}
+		else if (mConnection->flush()) {
+			ev_io_stop(mUpstreamLoop, &mUpstreamWrite.io);
+			upstreamSent();
+			// send the input that waited
+			writeActions();
+			flushUpstream();
+		}
 	}
 	catch (const std::runtime_error& e) {
-		mTerminating = true;
-		sendAction(makeEvent<EV(WriteAction,Ping)>());
-		printf("Reader terminating due to error: %s", e.what());
+		upstreamError(e.what());
 	}
-	printf("reader exit\n");
 }
 
+void AtenServer::upstreamDeadline() {
+	upstreamError(mUpstreamState == Connecting ?
+	              "connect timed out" : "read timed out");
+}
 
-void AtenServer::sendAction(const WriteAction& w) {
-	std::unique_lock<std::mutex> lock{mActionMutex};
-	mActionQueue.push(w);
-	mActionCond.notify_all();
+// The read deadline runs while part of the handshake or a message
+// is outstanding, and restarts whenever data arrives.
+void AtenServer::updateDeadline(bool activity) {
+	ev_timer& timer = mDeadlineTimer.timer;
+	if (mUpstreamState == ReadMessageType) {
+		ev_timer_stop(mUpstreamLoop, &timer);
+	}
+	else if (activity || !ev_is_active(&timer)) {
+		timer.repeat = mReadTimeout;
+		ev_timer_again(mUpstreamLoop, &timer);
+	}
 }
 
-void AtenServer::sendRFBUpdate(const RFBUpdate& u) {
-	std::unique_lock<std::mutex> lock{mRFBMutex};
+// for actions from the libev thread
+bool AtenServer::sendInputAction(const WriteAction& action) {
+	WriteAction w = action;
+	w.timestamp = monotonicNanos();
+	if (!mInputActions.push(w)) {
+		if (!mInputOverflow.exchange(true))
+			printf("input queue full, dropping events\n");
+		ev_async_send(mUpstreamLoop, &mUpstreamSignal.async);
+		mCounters.inputDropped.add();
+		return false;
+	}
+	ev_async_send(mUpstreamLoop, &mUpstreamSignal.async);
+	return true;
+}
+
+void AtenServer::sendRFBUpdate(const RFBUpdate& update) {
+	RFBUpdate u = update;
+	u.timestamp = monotonicNanos();
+	// waitForRFB made room for it
 	mRFBUpdates.push(u);
+	// ev_async_send only wakes the loop if the signal is not already
+	// pending, so a burst of updates costs one wakeup.
 	ev_async_send(mEVLoop, &mRFBSignal.async);
 }
 
 void AtenServer::keyEventHandler(rfbBool down, rfbKeySym keySym, rfbClientPtr cl) {
 	(void) cl;
-	sendAction(makeEvent<EV(WriteAction,Key)>(down, keySym));
+	sendInputAction(makeEvent<EV(WriteAction,Key)>(down, keySym));
+}
+
+void AtenServer::pointerEventHandler(int buttonMask, int x, int y, rfbClientPtr cl) {
+	sendInputAction(makeEvent<EV(WriteAction,Pointer)>(buttonMask, x, y));
+	// moves the cursor drawn for clients
+	rfbDefaultPtrAddEvent(buttonMask, x, y, cl);
 }
 
+void AtenServer::cutTextHandler(char *str, int len, rfbClientPtr cl) {
+	(void) cl;
+	std::string *text = new std::string(str, len);
+	if (!sendInputAction(makeEvent<EV(WriteAction,Paste)>(text)))
+		delete text;
+}
 
-AtenServer::AtenServer(int *argc, char **argv) {
-	mFBWidth = 640;
-	mFBHeight = 480;
-	mRFB = rfbGetScreen(argc, argv, mFBWidth, mFBHeight, 5, 3, 2);
-	mFrameBuffer = reinterpret_cast<char*>(malloc(mFBWidth * mFBHeight * 2));
-	memset(mFrameBuffer, 0, mFBWidth * mFBHeight * 2);
+enum rfbNewClientAction AtenServer::newClientHandler(rfbClientPtr cl) {
+	if (mClients++ == 0) {
+		mFirstClientTime = monotonicNanos();
+		mHaveClients = true;
+		ev_async_send(mUpstreamLoop, &mUpstreamSignal.async);
+	}
+
+	rfb_event_io *w = new rfb_event_io;
+	watchRFBSocket(w, cl->sock);
+	cl->clientData = w;
+	cl->clientGoneHook = [](rfbClientPtr cl) {
+		AtenServer *self = reinterpret_cast<AtenServer*>(
+			cl->screen->screenData);
+		self->clientGoneHandler(cl);
+	};
+	return RFB_CLIENT_ACCEPT;
+}
+
+void AtenServer::clientGoneHandler(rfbClientPtr cl) {
+	rfb_event_io *w = reinterpret_cast<rfb_event_io*>(cl->clientData);
+	ev_io_stop(mEVLoop, &w->io);
+	delete w;
+	cl->clientData = nullptr;
+
+	if (--mClients == 0) {
+		mHaveClients = false;
+		ev_async_send(mUpstreamLoop, &mUpstreamSignal.async);
+	}
+}
+
+// On the upstream loop, after input was queued or the first client
+// arrived or the last one left.
+void AtenServer::upstreamSignal() {
+	if (!mReplayPath.empty()) {
+		// connected once at start
+	}
+	else if (mHaveClients) {
+		ev_timer_stop(mUpstreamLoop, &mIdleTimer.timer);
+		if (mUpstreamState == Disconnected) {
+			if (!ev_is_active(&mReconnectTimer.timer))
+				connectUpstream();
+		}
+		else if (mUpdatesPaused) {
+			printf("client connected, resuming updates\n");
+			mUpdatesPaused = false;
+			mInput.requestUpdate(0);
+		}
+	}
+	else {
+		ev_timer_stop(mUpstreamLoop, &mReconnectTimer.timer);
+		if (mUpstreamState != Disconnected && !mUpdatesPaused &&
+		    !ev_is_active(&mIdleTimer.timer)) {
+			ev_timer_set(&mIdleTimer.timer, mIdleTimeout, 0.);
+			ev_timer_start(mUpstreamLoop, &mIdleTimer.timer);
+		}
+	}
+
+	// a client started waiting for an update
+	if (mUpdateDue && mDemand)
+		updateDue();
+
+	try {
+		writeActions();
+		if (mConnection)
+			flushUpstream();
+	}
+	catch (const std::runtime_error& e) {
+		upstreamError(e.what());
+	}
+}
+
+void AtenServer::printLatency() {
+	printf("latency for %s:%s\n", mTarget.host.c_str(), mTarget.port.c_str());
+	mInputQueueLatency.print("input queue");
+	mSendLatency.print("send");
+	mDecodeLatency.print("decode");
+	mDispatchLatency.print("dispatch");
+	mKeyToPixelLatency.print("key to pixel");
+	fflush(stdout);
+}
+
+void AtenServer::writeMetrics(MetricsText& out) {
+	static_assert(sizeof(kMessageTypeIds) == kMessageTypes,
+	              "message type ids and counters differ");
+	std::string target = "target=\"" + mTarget.host + ":" + mTarget.port + "\"";
+
+	for (int i = 0; i < kMessageTypes; i++) {
+		char labels[16];
+		snprintf(labels, sizeof(labels), ",type=\"0x%02x\"", kMessageTypeIds[i]);
+		out.add("aten_upstream_messages_total", "counter",
+		        "Messages received from the BMC, by type.",
+		        target + labels, mCounters.messages[i].get());
+		out.add("aten_upstream_message_bytes_total", "counter",
+		        "Bytes of messages received from the BMC, by type.",
+		        target + labels, mCounters.messageBytes[i].get());
+	}
+	out.add("aten_tiles_total", "counter",
+	        "Subrect tiles received, by whether they were decoded.",
+	        target + ",result=\"decoded\"", mCounters.tilesDecoded.get());
+	out.add("aten_tiles_total", "counter",
+	        "Subrect tiles received, by whether they were decoded.",
+	        target + ",result=\"unchanged\"", mCounters.tilesUnchanged.get());
+	out.add("aten_full_frames_total", "counter",
+	        "Entire frame updates decoded.",
+	        target, mCounters.fullFrames.get());
+	out.add("aten_frames_published_total", "counter",
+	        "Frames handed to the VNC side.",
+	        target, mCounters.framesPublished.get());
+	out.add("aten_dirty_pixels_total", "counter",
+	        "Area marked as modified in published frames, in pixels.",
+	        target, mCounters.dirtyPixels.get());
+	out.add("aten_upstream_reconnects_total", "counter",
+	        "Reconnects scheduled after a BMC connection error.",
+	        target, mCounters.reconnects.get());
+	out.add("aten_input_dropped_total", "counter",
+	        "Input events dropped because the queue was full.",
+	        target, mCounters.inputDropped.get());
+	out.add("aten_input_discarded_total", "counter",
+	        "Queued input events dropped after the queue was full.",
+	        target, mCounters.inputDiscarded.get());
+	out.add("aten_input_expired_total", "counter",
+	        "Input events dropped for waiting past the input deadline.",
+	        target, mCounters.inputExpired.get());
+	out.add("aten_pointer_merged_total", "counter",
+	        "Pointer motion events replaced by a later position.",
+	        target, mCounters.pointerMerged.get());
+	out.add("aten_input_queue_depth", "gauge",
+	        "Input events waiting for the BMC connection.",
+	        target, mInputActions.size());
+	out.add("aten_rfb_update_queue_depth", "gauge",
+	        "Updates waiting for the VNC side.",
+	        target, mRFBUpdates.size());
+	out.add("aten_vnc_clients", "gauge",
+	        "Connected VNC clients.",
+	        target, mClients);
+}
+
+void AtenServer::idleTimeout() {
+	if (mWarm) {
+		printf("no clients, pausing updates\n");
+		mUpdatesPaused = true;
+	}
+	else {
+		printf("no clients for %.0f seconds, disconnecting\n", mIdleTimeout);
+		closeUpstream();
+	}
+}
+
+void AtenServer::watchRFBSocket(rfb_event_io *w, int fd) {
+	w->self = this;
+	ev_io_init(&w->io, [](EV_P_ ev_io *w, int revents) {
+			(void) loop; (void) revents;
+			reinterpret_cast<rfb_event_io*>(w)->self->processRFBEvents();
+		}, fd, EV_READ);
+	ev_io_start(mEVLoop, &w->io);
+}
+
+void AtenServer::processRFBEvents() {
+	// libvncserver reports whether an update is still pending, which
+	// happens while it defers sending to coalesce modifications.
+	if (rfbProcessEvents(mRFB, 0) &&
+	    !ev_is_active(&mRFBDeferTimer.timer)) {
+		ev_timer_set(&mRFBDeferTimer.timer,
+		             (mRFB->deferUpdateTime + 1) / 1000.0, 0.);
+		ev_timer_start(mEVLoop, &mRFBDeferTimer.timer);
+	}
+	installTranslateFns();
+	updateDemand();
+}
+
+// A client is waiting for an update while its requested region is
+// not empty, libvncserver clears it once it has sent one.
+void AtenServer::updateDemand() {
+	bool demand = false;
+	rfbClientIteratorPtr it = rfbGetClientIterator(mRFB);
+	rfbClientPtr cl;
+	while (!demand && (cl = rfbClientIteratorNext(it)))
+		demand = !sraRgnEmpty(cl->requestedRegion);
+	rfbReleaseClientIterator(it);
+
+	if (demand != mDemand) {
+		mDemand = demand;
+		if (demand)
+			ev_async_send(mUpstreamLoop, &mUpstreamSignal.async);
+	}
+}
+
+// Translate function for client formats that pixels.cc converts to
+// directly, replacing libvncserver's table lookup per pixel.
+template <void (**convert)(char*, const char*, size_t), int outBytes>
+static void translatePixels(char *table, rfbPixelFormat *in, rfbPixelFormat *out,
+                            char *iptr, char *optr,
+                            int bytesBetweenInputLines, int width, int height) {
+	(void) table; (void) in; (void) out;
+	while (height --> 0) {
+		(*convert)(optr, iptr, width);
+		iptr += bytesBetweenInputLines;
+		optr += width * outBytes;
+	}
+}
+
+static rfbTranslateFnType fastTranslateFn(const rfbPixelFormat& f) {
+	if (!f.trueColour || f.bigEndian)
+		return nullptr;
+	if (f.bitsPerPixel == 32 &&
+	    f.redMax == 255 && f.greenMax == 255 && f.blueMax == 255 &&
+	    f.redShift == 16 && f.greenShift == 8 && f.blueShift == 0)
+		return translatePixels<&pixels_to_rgb888x, 4>;
+	if (f.bitsPerPixel == 16 &&
+	    f.redMax == 31 && f.greenMax == 63 && f.blueMax == 31 &&
+	    f.redShift == 11 && f.greenShift == 5 && f.blueShift == 0)
+		return translatePixels<&pixels_to_rgb565, 2>;
+	return nullptr;
+}
+
+// libvncserver sets up its generic translation whenever a client
+// sets its pixel format, so this is checked after processing events.
+void AtenServer::installTranslateFns() {
+	rfbClientIteratorPtr it = rfbGetClientIterator(mRFB);
+	rfbClientPtr cl;
+	while ((cl = rfbClientIteratorNext(it))) {
+		rfbTranslateFnType fn = fastTranslateFn(cl->format);
+		if (fn && cl->translateFn != fn)
+			cl->translateFn = fn;
+	}
+	rfbReleaseClientIterator(it);
+}
+
+
+AtenServer::AtenServer(struct ev_loop *loop, struct ev_loop *upstreamLoop,
+                       int *argc, char **argv, const AtenTarget& target)
+	: mTarget(target), mInput(mKeyMapper, mPasteTyper)
+{
+	mEVLoop = loop;
+	mUpstreamLoop = upstreamLoop;
+
+	if (mTarget.username.size() >= 24 || mTarget.password.size() >= 24) {
+		printf("username and password must be 0-23 characters each\n");
+		abort();
+	}
+	mUpstreamState = Disconnected;
+	mBackoff = kMinBackoff;
+
+	const char *keymap = getenv("ATEN_PROXY_KEYMAP");
+	if (keymap) {
+		try {
+			mKeyMapper.loadLayout(keymap);
+		}
+		catch (const std::runtime_error& e) {
+			errx(1, "%s", e.what());
+		}
+	}
 
+	const char *paste = getenv("ATEN_PROXY_PASTE");
+	mPaste = paste && atoi(paste);
+	const char *pasteRate = getenv("ATEN_PROXY_PASTE_RATE");
+	double rate = pasteRate ? atof(pasteRate) : 40;
+	if (rate <= 0)
+		errx(1, "ATEN_PROXY_PASTE_RATE must be positive");
+	mPasteTyper.setRate(rate);
+	mInputOverflow = false;
+	const char *inputDeadline = getenv("ATEN_PROXY_INPUT_DEADLINE");
+	mInputDeadline = (inputDeadline ? atof(inputDeadline) : 1) * 1e9;
+	mInput.setDeadline(mInputDeadline);
+
+	const char *maxFPS = getenv("ATEN_PROXY_MAX_FPS");
+	double fps = maxFPS ? atof(maxFPS) : 30;
+	mMinUpdateInterval = fps > 0 ? 1 / fps : 0; // 0 for no limit
+	mUpdateInterval = mMinUpdateInterval;
+	mLastRequestTime = 0;
+	mUpdateDue = false;
+	mDemand = false;
+	mSendStart = 0;
+	mFrameStart = 0;
+	mMessageIndex = 0;
+	mMessageStart = 0;
+	mUnsentKeyTime = 0;
+	mSentKeyTime = 0;
+
+	const char *connectTimeout = getenv("ATEN_PROXY_CONNECT_TIMEOUT");
+	mConnectTimeout = connectTimeout ? atof(connectTimeout) : 10;
+	const char *readTimeout = getenv("ATEN_PROXY_READ_TIMEOUT");
+	mReadTimeout = readTimeout ? atof(readTimeout) : 10;
+
+	const char *statsInterval = getenv("ATEN_PROXY_STATS");
+	mStatsInterval = statsInterval ? atoi(statsInterval) : 0;
+	memset(&mFrameStats, 0, sizeof(mFrameStats));
+
+	const char *idleTimeout = getenv("ATEN_PROXY_IDLE_TIMEOUT");
+	mIdleTimeout = idleTimeout ? atof(idleTimeout) : 30;
+	const char *warm = getenv("ATEN_PROXY_WARM");
+	mWarm = warm && atoi(warm);
+	mClients = 0;
+	mHaveClients = false;
+	mUpdatesPaused = false;
+	mFirstClientTime = 0;
+
+	if (!mTarget.recordPath.empty()) {
+		try {
+			mCapture.reset(new CaptureWriter(mTarget.recordPath.c_str()));
+		}
+		catch (const std::runtime_error& e) {
+			errx(1, "%s: %s", mTarget.recordPath.c_str(), e.what());
+		}
+		printf("recording to %s\n", mTarget.recordPath.c_str());
+	}
+	const char *replay = getenv("ATEN_PROXY_REPLAY");
+	if (replay)
+		mReplayPath = replay;
+	const char *realtime = getenv("ATEN_PROXY_REPLAY_REALTIME");
+	mReplayRealtime = realtime && atoi(realtime);
+	mReplayStart = 0;
+	mReplayFrames = 0;
+
+	for (int i = 0; i < kBuffers; i++)
+		mStale[i] = sraRgnCreate();
+	mFrameRegion = sraRgnCreate();
+	mArena = nullptr;
+	mSlotLen = 0;
+	mNewArena = false;
+	mFramesPublished = 0;
+	resizeBuffers(640, 480);
+	mDecoder.resize(640, 480);
+
+	// the first buffer is shown as frame 0
+	mNewArena = false;
+	mResized = false;
+	mHaveBackBuffer = false;
+	mFramesPublished = 1;
+	mFramesShown = 1;
+	mRFBWait = false;
+	mRFBAckWanted = false;
+	mShownArena = mArena;
+	mShownArenaLen = mArenaLen;
+
+	mRFB = rfbGetScreen(argc, argv, mFBWidth, mFBHeight, 5, 3, 2);
 	mRFB->desktopName = strdup("aten-proxy");
 	mRFB->frameBuffer = mFrameBuffer;
 	mRFB->kbdAddEvent = [](rfbBool down, rfbKeySym keySym, rfbClientPtr cl){
@@ -457,38 +1703,65 @@ AtenServer::AtenServer(int *argc, char **argv) {
 			cl->screen->screenData);
 		self->keyEventHandler(down, keySym, cl);
 	};
+	mRFB->ptrAddEvent = [](int buttonMask, int x, int y, rfbClientPtr cl){
+		AtenServer *self = reinterpret_cast<AtenServer*>(
+			cl->screen->screenData);
+		self->pointerEventHandler(buttonMask, x, y, cl);
+	};
+	if (mPaste) {
+		mRFB->setXCutText = [](char *str, int len, rfbClientPtr cl){
+			AtenServer *self = reinterpret_cast<AtenServer*>(
+				cl->screen->screenData);
+			self->cutTextHandler(str, len, cl);
+		};
+	}
+	mRFB->newClientHook = [](rfbClientPtr cl){
+		AtenServer *self = reinterpret_cast<AtenServer*>(
+			cl->screen->screenData);
+		return self->newClientHandler(cl);
+	};
 
-	rfbInitServer(mRFB);
+	if (mTarget.vncPort) {
+		mRFB->autoPort = FALSE;
+		mRFB->port = mRFB->ipv6port = mTarget.vncPort;
+	}
 
-	keymap_init();
+	rfbInitServer(mRFB);
 }
 
 void AtenServer::handleRFBUpdates() {
+	int64_t now = monotonicNanos();
 	while (true) {
 		RFBUpdate ev;
-		{
-			std::unique_lock<std::mutex> lock{mRFBMutex};
-			if (mRFBUpdates.empty())
-				return;
-			ev = mRFBUpdates.front();
-			mRFBUpdates.pop();
-		}
+		if (!mRFBUpdates.pop(ev))
+			break;
+		mDispatchLatency.record(now - ev.timestamp);
 		// printf("handleRFBUpdate, type=%d\n", ev.type);
 		switch (ev.type) {
 		case RFBUpdate::SetFramebuffer: {
 			auto& p = ev.setFramebuffer;
-			char *oldFramebuffer = mRFB->frameBuffer;
 			printf("framebuffer change: %p[%dx%d] -> %p[%dx%d]\n",
-				   oldFramebuffer, mRFB->width, mRFB->height,
-				   p.newFramebuffer, p.width, p.height);
-			rfbNewFramebuffer(mRFB, p.newFramebuffer, p.width, p.height, 5, 3, 2);
-			free(oldFramebuffer);
+				   mRFB->frameBuffer, mRFB->width, mRFB->height,
+				   p.front, p.width, p.height);
+			rfbNewFramebuffer(mRFB, p.front, p.width, p.height, 5, 3, 2);
+			if (p.arena != mShownArena) {
+				munmap(mShownArena, mShownArenaLen);
+				mShownArena = p.arena;
+				mShownArenaLen = p.arenaLen;
+			}
+			mFramesShown.store(p.frame + 1, std::memory_order_release);
 			break;
 		}
 
-		case RFBUpdate::AddDirtyRect: {
-			auto &p = ev.addDirtyRect;
-			rfbMarkRectAsModified(mRFB, p.x1, p.y1, p.x2, p.y2);
+		case RFBUpdate::PublishFrame: {
+			auto &p = ev.publishFrame;
+			mRFB->frameBuffer = p.buffer;
+			rfbMarkRegionAsModified(mRFB, p.region);
+			sraRgnDestroy(p.region);
+			if (p.inputTime)
+				mKeyToPixelLatency.record(now - p.inputTime);
+			// the previous buffer is no longer read
+			mFramesShown.store(p.frame + 1, std::memory_order_release);
 			break;
 		}
 
@@ -505,34 +1778,46 @@ void AtenServer::handleRFBUpdates() {
 
 		}
 	}
+
+	// the parser may be waiting for the frames shown or the room made
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (mRFBAckWanted.load(std::memory_order_relaxed)) {
+		mRFBAckWanted.store(false, std::memory_order_relaxed);
+		ev_async_send(mUpstreamLoop, &mRFBAck.async);
+	}
 }
 
-void AtenServer::run() {
+void AtenServer::start() {
 	// set here instead of constructor to not break inheritance
 	mRFB->screenData = this;
 
-	struct ev_loop *loop = mEVLoop = EV_DEFAULT;
+	struct ev_loop *loop = mEVLoop;
 
-	// really simple integration of libvncserver's event loop into
-	// libev. while completely useless now, ideally this integration
-	// would be extended to monitor the sockets used by libvncserver.
-	ev_idle keepalive;
-	ev_idle_init(&keepalive, [](EV_P_ ev_idle *w, int revents){
-			(void) loop; (void) w; (void) revents;
-			// global idle handler prevents loop from sleeping.
-		});
-	ev_idle_start(loop, &keepalive);
+	// libvncserver is only stepped when one of its sockets is ready,
+	// so the loop can sleep while nothing is happening.
+	const int listenSockets[] = {
+		mRFB->listenSock, mRFB->listen6Sock,
+		mRFB->httpListenSock, mRFB->httpListen6Sock,
+	};
+	for (size_t i = 0; i < sizeof(listenSockets) / sizeof(*listenSockets); i++) {
+		if (listenSockets[i] >= 0)
+			watchRFBSocket(&mRFBListeners[i], listenSockets[i]);
+	}
 
-	rfb_event_check c;
-	c.rfb = mRFB;
-	ev_check_init(&c.check, [](EV_P_ ev_check *w, int revents){
-			// once around every libev loop we step the libvncserver
-			// loop.
+	mRFBDeferTimer.self = this;
+	ev_timer_init(&mRFBDeferTimer.timer, [](EV_P_ ev_timer *w, int revents) {
 			(void) loop; (void) revents;
-			rfbScreenInfoPtr p = reinterpret_cast<rfb_event_check*>(w)->rfb;
-			rfbProcessEvents(p, -1);
-		});
-	ev_check_start(loop, &c.check);
+			AtenServer *self = reinterpret_cast<decltype(mRFBDeferTimer)*>(w)->self;
+			self->processRFBEvents();
+		}, 0., 0.);
+
+	mLatencySignal.self = this;
+	ev_signal_init(&mLatencySignal.signal, [](EV_P_ ev_signal *w, int revents) {
+			(void) loop; (void) revents;
+			AtenServer *self = reinterpret_cast<decltype(mLatencySignal)*>(w)->self;
+			self->printLatency();
+		}, SIGUSR1);
+	ev_signal_start(loop, &mLatencySignal.signal);
 
 	// and a way to stuff events into the libvncserver loop:
 	mRFBSignal.self = this;
@@ -540,95 +1825,209 @@ void AtenServer::run() {
 			(void) loop; (void) revents;
 			AtenServer *self = reinterpret_cast<decltype(mRFBSignal)*>(w)->self;
 			self->handleRFBUpdates();
+			// send the new modifications to waiting clients
+			self->processRFBEvents();
 		});
 	ev_async_start(loop, &mRFBSignal.async);
 
-	std::thread{ev_run, loop, 0}.detach();
-
-	const char *host = getenv("ATEN_PROXY_HOST");
-	const char *port = getenv("ATEN_PROXY_PORT");
-	const char *username = getenv("ATEN_PROXY_USERNAME");
-	const char *password = getenv("ATEN_PROXY_PASSWORD");
-	while (true) {
-		try {
-			struct {
-				char username[24];
-				char password[24];
-			} auth;
-			if (strlen(username) >= 24 || strlen(password) >= 24) {
-				printf("username and password must be 0-23 characters each\n");
-				abort();
-			}
-			strncpy(auth.username, username, sizeof(auth.username));
-			strncpy(auth.password, password, sizeof(auth.password));
-
-			mConnection = std::unique_ptr<Connection>{
-				new Connection(host, port)};
+	// upstream side
+	loop = mUpstreamLoop;
 
-			fprintf(stderr, "Connected\n");
+	mUpstreamSignal.self = this;
+	ev_async_init(&mUpstreamSignal.async, [](EV_P_ ev_async *w, int revents) {
+			(void) loop; (void) revents;
+			AtenServer *self = reinterpret_cast<decltype(mUpstreamSignal)*>(w)->self;
+			self->upstreamSignal();
+		});
+	ev_async_start(loop, &mUpstreamSignal.async);
 
-			// handshake
-			mConnection->readBytes(strlen("RFB 003.008\n"));
-			mConnection->writeString("RFB 003.008\n");
+	mRFBAck.self = this;
+	ev_async_init(&mRFBAck.async, [](EV_P_ ev_async *w, int revents) {
+			(void) loop; (void) revents;
+			AtenServer *self = reinterpret_cast<decltype(mRFBAck)*>(w)->self;
+			self->rfbAcknowledged();
+		});
+	ev_async_start(loop, &mRFBAck.async);
 
-			fprintf(stderr, "Completed handshake\n");
+	mUpstreamRead.self = this;
+	ev_io_init(&mUpstreamRead.io, [](EV_P_ ev_io *w, int revents) {
+			(void) loop; (void) revents;
+			AtenServer *self = reinterpret_cast<decltype(mUpstreamRead)*>(w)->self;
+			self->upstreamReadable();
+		}, -1, EV_READ);
 
-			// security type
-			int nSecurity = mConnection->readRaw<uint8_t>();
-			char *security = mConnection->readBytes(nSecurity);
-			if (security[0] != 16) {
-				abort();
-			}
-			mConnection->writeRaw<uint8_t>(16);
+	mUpstreamWrite.self = this;
+	ev_io_init(&mUpstreamWrite.io, [](EV_P_ ev_io *w, int revents) {
+			(void) loop; (void) revents;
+			AtenServer *self = reinterpret_cast<decltype(mUpstreamWrite)*>(w)->self;
+			self->upstreamWritable();
+		}, -1, EV_WRITE);
 
-			// unknown reply from aten, 24 bytes
-			(void) mConnection->readBytes(24);
+	mDeadlineTimer.self = this;
+	ev_init(&mDeadlineTimer.timer, [](EV_P_ ev_timer *w, int revents) {
+			(void) loop; (void) revents;
+			AtenServer *self = reinterpret_cast<decltype(mDeadlineTimer)*>(w)->self;
+			self->upstreamDeadline();
+		});
 
-			fprintf(stderr, "Negotiated security type\n");
+	mReconnectTimer.self = this;
+	ev_timer_init(&mReconnectTimer.timer, [](EV_P_ ev_timer *w, int revents) {
+			(void) loop; (void) revents;
+			AtenServer *self = reinterpret_cast<decltype(mReconnectTimer)*>(w)->self;
+			if (self->mHaveClients)
+				self->connectUpstream();
+		}, 0., 0.);
 
-			// auth
-			mConnection->writeBytes((char*) &auth, sizeof(auth));
-			int authErr = mConnection->readRaw<uint32_t>();
-			if (authErr) {
-				abort();
-			}
+	mIdleTimer.self = this;
+	ev_timer_init(&mIdleTimer.timer, [](EV_P_ ev_timer *w, int revents) {
+			(void) loop; (void) revents;
+			AtenServer *self = reinterpret_cast<decltype(mIdleTimer)*>(w)->self;
+			self->idleTimeout();
+		}, 0., 0.);
 
-			// client init
-			mConnection->writeRaw<uint8_t>(0);
+	mUpdateTimer.self = this;
+	ev_timer_init(&mUpdateTimer.timer, [](EV_P_ ev_timer *w, int revents) {
+			(void) loop; (void) revents;
+			AtenServer *self = reinterpret_cast<decltype(mUpdateTimer)*>(w)->self;
+			self->updateTimeout();
+		}, 0., 0.);
 
-			// server init; aten sends complete garbaage
-			(void) mConnection->readBytes(sizeof(uint16_t) * 2 + 16); // dimensions
+	mPasteTimer.self = this;
+	ev_timer_init(&mPasteTimer.timer, [](EV_P_ ev_timer *w, int revents) {
+			(void) loop; (void) revents;
+			AtenServer *self = reinterpret_cast<decltype(mPasteTimer)*>(w)->self;
+			self->pasteTimeout();
+		}, 0., PasteTyper::kInterval);
 
-			int serverNameLen = ntohl(mConnection->readRaw<uint32_t>());
-			char *serverName = mConnection->readBytes(serverNameLen);
-			RFBUpdate u;
-			u.type = RFBUpdate::SetServerName;
-			u.setServerName.name = strdup(serverName);
-			sendRFBUpdate(u);
+	if (!mReplayPath.empty()) {
+		replaysRunning++;
+		connectUpstream();
+	}
+}
 
-			// more aten unknown
-			(void) mConnection->readBytes(12);
+// Reads targets, one per line, as
+//   vnc-port host port username password
+// Blank lines and lines starting with # are ignored.
+static std::vector<AtenTarget> readTargets(const char *path) {
+	std::ifstream in{path};
+	if (!in)
+		err(1, "%s", path);
+
+	std::vector<AtenTarget> targets;
+	std::string line;
+	for (int lineno = 1; std::getline(in, line); lineno++) {
+		std::istringstream fields{line};
+		AtenTarget t;
+		if (!(fields >> t.vncPort)) {
+			fields.clear();
+			std::string word;
+			if (!(fields >> word) || word[0] == '#')
+				continue;
+			errx(1, "%s:%d: expected a port number", path, lineno);
+		}
+		if (!(fields >> t.host >> t.port >> t.username >> t.password))
+			errx(1, "%s:%d: expected vnc-port host port username password",
+			     path, lineno);
+		targets.push_back(t);
+	}
+	return targets;
+}
 
-			// initial screen update
-			sendAction(makeEvent<EV(WriteAction, UpdateFramebuffer)>(0, 0, 0, 0, 0));
+int main(int argc, char **argv) {
+	pixels_init();
+	printf("pixel conversion: %s\n", pixels_implementation());
 
-			fprintf(stderr, "Sent request for initial update\n");
+	std::vector<AtenTarget> targets;
+	const char *config = getenv("ATEN_PROXY_CONFIG");
+	if (config) {
+		targets = readTargets(config);
+	}
+	else if (getenv("ATEN_PROXY_REPLAY") && !getenv("ATEN_PROXY_HOST")) {
+		// nothing is connected to, the BMC is played from a capture
+		targets.push_back(AtenTarget{0, "replay", "0", "", "", "", nullptr});
+	}
+	else {
+		const char *env[] = {
+			"ATEN_PROXY_HOST", "ATEN_PROXY_PORT",
+			"ATEN_PROXY_USERNAME", "ATEN_PROXY_PASSWORD",
+		};
+		for (const char *name : env) {
+			if (!getenv(name))
+				errx(1, "%s must be set, or ATEN_PROXY_CONFIG", name);
+		}
+		targets.push_back(AtenTarget{
+				0, getenv(env[0]), getenv(env[1]),
+				getenv(env[2]), getenv(env[3]), "", nullptr});
+	}
 
-			mWriterThread = std::thread{[this]{doWriter();}};
-			mReaderThread = std::thread{[this]{doReader();}};
-			mWriterThread.join();
-			mReaderThread.join();
-			mTerminating.store(false);
-			mConnection = nullptr;
+	if (!getenv("ATEN_PROXY_REPLAY")) {
+		for (AtenTarget& t : targets) {
+			try {
+				t.addresses = NetworkUtils::resolve(t.host.c_str(), t.port.c_str());
+			}
+			catch (const std::runtime_error& e) {
+				errx(1, "%s port %s: %s", t.host.c_str(), t.port.c_str(), e.what());
+			}
 		}
-		catch (const std::runtime_error& x) {
-			printf("connection error: %s\n", x.what());
-			sleep(1);
+	}
+
+	const char *record = getenv("ATEN_PROXY_RECORD");
+	if (record) {
+		for (AtenTarget& t : targets) {
+			t.recordPath = record;
+			if (targets.size() > 1)
+				t.recordPath += "." + t.host + "-" + t.port;
 		}
 	}
-}
 
-int main(int argc, char **argv) {
-	AtenServer server {&argc, argv};
-	server.run();
+	// All servers share one event loop for the VNC side, on this
+	// thread, and another for their BMC connections.
+	struct ev_loop *loop = EV_DEFAULT;
+	struct ev_loop *upstreamLoop = ev_loop_new(EVFLAG_AUTO);
+	// The servers' upstreams share a thread, so they can share the
+	// decode threads too.
+	const char *decodeThreads = getenv("ATEN_PROXY_DECODE_THREADS");
+	int threads = decodeThreads ? atoi(decodeThreads)
+		: std::min(4u, std::max(1u, std::thread::hardware_concurrency()));
+	std::unique_ptr<DecodePool> decodePool;
+	if (threads > 1) {
+		decodePool.reset(new DecodePool(threads));
+		printf("decode threads: %d\n", threads);
+	}
+
+	// started before the servers, as a replay may fail right away
+	auto stop = [](EV_P_ ev_async *, int) {
+		ev_break(EV_A_ EVBREAK_ALL);
+	};
+	ev_async_init(&stopLoop, stop);
+	ev_async_start(loop, &stopLoop);
+	ev_async_init(&stopUpstreamLoop, stop);
+	ev_async_start(upstreamLoop, &stopUpstreamLoop);
+
+	std::vector<std::unique_ptr<AtenServer>> servers;
+	for (const AtenTarget& target : targets) {
+		// libvncserver consumes the options it recognises
+		std::vector<char*> args{argv, argv + argc + 1};
+		int nargs = argc;
+		servers.emplace_back(new AtenServer(
+				loop, upstreamLoop, &nargs, args.data(), target));
+	}
+	for (auto& server : servers) {
+		server->setDecodePool(decodePool.get());
+		server->start();
+	}
+
+	std::unique_ptr<MetricsServer> metrics;
+	const char *metricsPort = getenv("ATEN_PROXY_METRICS_PORT");
+	if (metricsPort) {
+		metrics.reset(new MetricsServer(loop, atoi(metricsPort),
+			[&servers](MetricsText& out) {
+				for (auto& server : servers)
+					server->writeMetrics(out);
+			}));
+	}
+
+	std::thread upstream{[upstreamLoop]{ ev_run(upstreamLoop, 0); }};
+	ev_run(loop, 0);
+	upstream.join();
 }
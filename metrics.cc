@@ -0,0 +1,165 @@
+#include "metrics.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+void MetricsText::add(const char *name, const char *type, const char *help,
+                      const std::string& labels, uint64_t value) {
+	Family *family = nullptr;
+	for (Family& f : mFamilies) {
+		if (f.name == name) {
+			family = &f;
+			break;
+		}
+	}
+	if (!family) {
+		mFamilies.push_back(Family{name, "", ""});
+		family = &mFamilies.back();
+		family->header = std::string("# HELP ") + name + " " + help + "\n" +
+			"# TYPE " + name + " " + type + "\n";
+	}
+
+	char buf[32];
+	snprintf(buf, sizeof(buf), " %llu\n", (unsigned long long) value);
+	family->samples += name;
+	if (!labels.empty())
+		family->samples += "{" + labels + "}";
+	family->samples += buf;
+}
+
+std::string MetricsText::str() const {
+	std::string out;
+	for (const Family& f : mFamilies)
+		out += f.header + f.samples;
+	return out;
+}
+
+namespace {
+
+// a scraper connection, reading its request and then writing the
+// response, which with many targets is larger than the socket's send
+// buffer
+struct MetricsClient {
+	ev_io io;
+	MetricsServer *self;
+	std::string request;
+	std::string response;
+	size_t sent;
+};
+
+void closeClient(struct ev_loop *loop, MetricsClient *client) {
+	ev_io_stop(loop, &client->io);
+	close(client->io.fd);
+	delete client;
+}
+
+void writeResponse(EV_P_ ev_io *w, int revents) {
+	(void) revents;
+	MetricsClient *client = reinterpret_cast<MetricsClient*>(w);
+	while (client->sent < client->response.size()) {
+		ssize_t n = send(w->fd, client->response.data() + client->sent,
+		                 client->response.size() - client->sent, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			return;
+		if (n < 0) {
+			printf("metrics response: %s\n", strerror(errno));
+			break;
+		}
+		client->sent += n;
+	}
+	closeClient(EV_A_ client);
+}
+
+}
+
+MetricsServer::MetricsServer(struct ev_loop *loop, int port, Collector collect)
+	: mLoop(loop), mCollect(collect)
+{
+	mSocket = unique_fd(socket(AF_INET, SOCK_STREAM, 0));
+	if (mSocket < 0)
+		err(1, "metrics socket");
+	fcntl(mSocket, F_SETFL, fcntl(mSocket, F_GETFL) | O_NONBLOCK);
+	fcntl(mSocket, F_SETFD, FD_CLOEXEC);
+	int one = 1;
+	setsockopt(mSocket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(mSocket, (struct sockaddr*) &addr, sizeof(addr)) < 0)
+		err(1, "metrics bind to port %d", port);
+	if (listen(mSocket, 16) < 0)
+		err(1, "metrics listen");
+	printf("metrics on http://127.0.0.1:%d/metrics\n", port);
+
+	mListener.self = this;
+	ev_io_init(&mListener.io, [](EV_P_ ev_io *w, int revents) {
+			(void) loop; (void) revents;
+			MetricsServer *self = reinterpret_cast<decltype(mListener)*>(w)->self;
+			self->accept();
+		}, mSocket, EV_READ);
+	ev_io_start(mLoop, &mListener.io);
+}
+
+void MetricsServer::accept() {
+	int fd = ::accept(mSocket, nullptr, nullptr);
+	if (fd < 0)
+		return;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	MetricsClient *client = new MetricsClient;
+	client->self = this;
+	client->sent = 0;
+	ev_io_init(&client->io, [](EV_P_ ev_io *w, int revents) {
+			MetricsClient *client = reinterpret_cast<MetricsClient*>(w);
+			char buf[1024];
+			ssize_t n = read(w->fd, buf, sizeof(buf));
+			if (n < 0 && (errno == EAGAIN || errno == EINTR))
+				return;
+			if (n <= 0) {
+				closeClient(EV_A_ client);
+				return;
+			}
+			client->request.append(buf, n);
+			// only the end of the headers matters
+			if (client->request.find("\r\n\r\n") == std::string::npos &&
+			    client->request.size() <= 8192)
+				return;
+
+			// the rest of the response is sent as the socket drains
+			client->response = client->self->response();
+			ev_io_stop(EV_A_ w);
+			ev_io_set(w, w->fd, EV_WRITE);
+			ev_set_cb(w, writeResponse);
+			ev_io_start(EV_A_ w);
+			writeResponse(EV_A_ w, revents);
+		}, fd, EV_READ);
+	ev_io_start(mLoop, &client->io);
+}
+
+std::string MetricsServer::response() {
+	MetricsText text;
+	mCollect(text);
+	std::string body = text.str();
+
+	char header[128];
+	snprintf(header, sizeof(header),
+	         "HTTP/1.0 200 OK\r\n"
+	         "Content-Type: text/plain; version=0.0.4\r\n"
+	         "Content-Length: %zu\r\n"
+	         "Connection: close\r\n\r\n", body.size());
+	return header + body;
+}
@@ -0,0 +1,76 @@
+// -*- c++ -*-
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <ev.h>
+
+#include "unique_fd.h"
+
+// Counter written by one thread only and read by the metrics server
+// on another. With a single writer an increment needs no locked
+// instruction, just a relaxed load and store.
+class Counter {
+	std::atomic<uint64_t> mValue;
+
+public:
+	Counter() : mValue(0) {}
+
+	void add(uint64_t n = 1) {
+		mValue.store(mValue.load(std::memory_order_relaxed) + n,
+		             std::memory_order_relaxed);
+	}
+
+	uint64_t get() const {
+		return mValue.load(std::memory_order_relaxed);
+	}
+};
+
+// Builds a scrape in the Prometheus text format. Samples of the same
+// metric are grouped under one HELP and TYPE, in the order the
+// metrics were first seen.
+class MetricsText {
+	struct Family {
+		std::string name;
+		std::string header;
+		std::string samples;
+	};
+	std::vector<Family> mFamilies;
+
+public:
+	// labels are given without braces, e.g. target="host:5900"
+	void add(const char *name, const char *type, const char *help,
+	         const std::string& labels, uint64_t value);
+
+	std::string str() const;
+};
+
+// Serves the metrics over plain HTTP on the loopback interface, on
+// the given event loop. Every request gets the same response,
+// whatever its path.
+class MetricsServer {
+public:
+	typedef std::function<void(MetricsText&)> Collector;
+
+	MetricsServer(struct ev_loop *loop, int port, Collector collect);
+
+private:
+	void accept();
+	std::string response();
+
+	struct ev_loop *mLoop;
+	unique_fd mSocket;
+	Collector mCollect;
+	struct {
+		ev_io io;
+		MetricsServer *self;
+	} mListener;
+};
+
+#endif /* _METRICS_H_ */
@@ -0,0 +1,75 @@
+#include <string.h>
+
+#include <arpa/inet.h>
+
+#include "paste.h"
+
+void appendKeyPresses(std::vector<char>& batch,
+                      const std::vector<KeyPress>& presses) {
+	for (const KeyPress& press : presses) {
+		struct {
+			uint8_t messageType;
+			uint8_t padding1;
+			uint8_t down;
+			char padding2[2];
+			uint32_t key;
+			char padding3[9];
+		} __attribute__((packed)) req;
+		memset(&req, 0, sizeof(req));
+		req.messageType = 4;
+		req.down = press.down;
+		req.key = htonl(press.usage);
+		const char *p = reinterpret_cast<const char*>(&req);
+		batch.insert(batch.end(), p, p + sizeof(req));
+	}
+}
+
+PasteTyper::PasteTyper() {
+	mRate = 40;
+	mCredit = 0;
+	mOffset = 0;
+}
+
+bool PasteTyper::add(const std::string& text) {
+	if (!typing())
+		mCredit = 0;
+	mText.erase(0, mOffset);
+	mOffset = 0;
+	if (mText.size() + text.size() > kMaxLen)
+		return false;
+	mText += text;
+	return true;
+}
+
+void PasteTyper::typeBatch(KeyMapper& mapper, std::vector<char>& batch) {
+	std::vector<KeyPress> presses;
+	mCredit += mRate * kInterval;
+	while (mCredit >= 1 && mOffset < mText.size()) {
+		uint8_t c = mText[mOffset++];
+		rfbKeySym keysym = c;
+		if (c == '\r' || c == '\n') {
+			if (c == '\r' && mOffset < mText.size() && mText[mOffset] == '\n')
+				mOffset++;
+			keysym = XK_Return;
+		}
+		else if (c == '\t') {
+			keysym = XK_Tab;
+		}
+		else if (c < 0x20 || c == 0x7f) {
+			continue;
+		}
+
+		presses.clear();
+		mapper.keyEvent(keysym, true, presses);
+		mapper.keyEvent(keysym, false, presses);
+		appendKeyPresses(batch, presses);
+		mCredit -= 1;
+	}
+	if (!typing())
+		clear();
+}
+
+void PasteTyper::clear() {
+	mText.clear();
+	mOffset = 0;
+}
@@ -0,0 +1,54 @@
+// -*- c++ -*-
+#ifndef _PASTE_H_
+#define _PASTE_H_
+
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+#include "keymap.h"
+
+// Encodes HID key events as ATEN key event messages.
+void appendKeyPresses(std::vector<char>& batch,
+                      const std::vector<KeyPress>& presses);
+
+// Text pasted by a client, typed at a limited number of characters
+// per second so the BMC doesn't drop keys. The owner calls typeBatch
+// every kInterval while typing.
+class PasteTyper {
+public:
+	static const size_t kMaxLen = 64 * 1024;
+	static constexpr double kInterval = 0.05;
+
+	PasteTyper();
+
+	// characters per second
+	void setRate(double rate) {
+		mRate = rate;
+	}
+
+	// Queues text to be typed. Returns false, dropping it, if more
+	// than kMaxLen characters would be waiting.
+	bool add(const std::string& text);
+
+	bool typing() const {
+		return mOffset < mText.size();
+	}
+
+	// Appends the key events for the characters due in this interval
+	// to batch, through mapper. Cut text is Latin-1, which are also
+	// the keysyms, apart from line breaks and tabs; other control
+	// characters are skipped.
+	void typeBatch(KeyMapper& mapper, std::vector<char>& batch);
+
+	void clear();
+
+private:
+	double mRate;
+	double mCredit; // characters that may be typed this interval
+	std::string mText;
+	size_t mOffset; // next character to type
+};
+
+#endif /* _PASTE_H_ */
@@ -0,0 +1,399 @@
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PIXELS_X86 1
+#endif
+
+#if defined(__ARM_NEON) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <arm_neon.h>
+#define PIXELS_NEON 1
+#endif
+
+#include "pixels.h"
+
+// Reference implementation. The vector kernels below must produce
+// identical output for every 16 bit input, including dropping the
+// unused top bit.
+static void copyPixelsScalar(char *out, const char *in, size_t count) {
+	while (count --> 0) {
+		const uint16_t ip = (in[0] & 0xff) | (in[1] << 8);
+
+		uint8_t r = (ip >> 10) & 0x1f;
+		uint8_t g = (ip >> 5) & 0x1f;
+		uint8_t b = ip & 0x1f;
+
+		const uint16_t op = r | g << 5 | b << 10;
+
+		out[0] = op & 0xff;
+		out[1] = op >> 8;
+		out += 2;
+		in += 2;
+	}
+}
+
+#ifdef PIXELS_X86
+#if defined(__SSE2__)
+static void copyPixelsSSE2(char *out, const char *in, size_t count) {
+	const __m128i maskLow = _mm_set1_epi16(0x001f);
+	const __m128i maskMid = _mm_set1_epi16(0x03e0);
+	const __m128i maskHigh = _mm_set1_epi16(0x7c00);
+
+	for (; count >= 8; count -= 8, in += 16, out += 16) {
+		__m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+		__m128i r = _mm_and_si128(_mm_srli_epi16(p, 10), maskLow);
+		__m128i g = _mm_and_si128(p, maskMid);
+		__m128i b = _mm_and_si128(_mm_slli_epi16(p, 10), maskHigh);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out),
+		                 _mm_or_si128(_mm_or_si128(r, g), b));
+	}
+	copyPixelsScalar(out, in, count);
+}
+#endif
+
+__attribute__((target("avx2")))
+static void copyPixelsAVX2(char *out, const char *in, size_t count) {
+	const __m256i maskLow = _mm256_set1_epi16(0x001f);
+	const __m256i maskMid = _mm256_set1_epi16(0x03e0);
+	const __m256i maskHigh = _mm256_set1_epi16(0x7c00);
+
+	for (; count >= 16; count -= 16, in += 32, out += 32) {
+		__m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in));
+		__m256i r = _mm256_and_si256(_mm256_srli_epi16(p, 10), maskLow);
+		__m256i g = _mm256_and_si256(p, maskMid);
+		__m256i b = _mm256_and_si256(_mm256_slli_epi16(p, 10), maskHigh);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(out),
+		                    _mm256_or_si256(_mm256_or_si256(r, g), b));
+	}
+	copyPixelsScalar(out, in, count);
+}
+#endif
+
+#ifdef PIXELS_NEON
+static void copyPixelsNEON(char *out, const char *in, size_t count) {
+	const uint16x8_t maskLow = vdupq_n_u16(0x001f);
+	const uint16x8_t maskMid = vdupq_n_u16(0x03e0);
+	const uint16x8_t maskHigh = vdupq_n_u16(0x7c00);
+
+	for (; count >= 8; count -= 8, in += 16, out += 16) {
+		uint16x8_t p = vreinterpretq_u16_u8(
+			vld1q_u8(reinterpret_cast<const uint8_t*>(in)));
+		uint16x8_t r = vandq_u16(vshrq_n_u16(p, 10), maskLow);
+		uint16x8_t g = vandq_u16(p, maskMid);
+		uint16x8_t b = vandq_u16(vshlq_n_u16(p, 10), maskHigh);
+		vst1q_u8(reinterpret_cast<uint8_t*>(out),
+		         vreinterpretq_u8_u16(vorrq_u16(vorrq_u16(r, g), b)));
+	}
+	copyPixelsScalar(out, in, count);
+}
+#endif
+
+// Client format conversions from the screen's BGR555. Components are
+// scaled exactly as libvncserver's translation tables do, which is
+// (v * max + 15) / 31. Division by 31 is done as a multiply by
+// kDivide31 and a shift by 19, which is exact for all v * max + 15 <=
+// 31 * 255 + 15.
+static const unsigned kDivide31 = 16913;
+
+static inline unsigned scaleComponent(unsigned v, unsigned max) {
+	return (v * max + 15) / 31;
+}
+
+static void toRGB888xScalar(char *out, const char *in, size_t count) {
+	while (count --> 0) {
+		const uint16_t ip = (in[0] & 0xff) | (in[1] << 8);
+
+		out[0] = scaleComponent((ip >> 10) & 0x1f, 255);
+		out[1] = scaleComponent((ip >> 5) & 0x1f, 255);
+		out[2] = scaleComponent(ip & 0x1f, 255);
+		out[3] = 0;
+		out += 4;
+		in += 2;
+	}
+}
+
+static void toRGB565Scalar(char *out, const char *in, size_t count) {
+	while (count --> 0) {
+		const uint16_t ip = (in[0] & 0xff) | (in[1] << 8);
+
+		uint8_t r = ip & 0x1f;
+		uint8_t g = scaleComponent((ip >> 5) & 0x1f, 63);
+		uint8_t b = (ip >> 10) & 0x1f;
+
+		const uint16_t op = r << 11 | g << 5 | b;
+
+		out[0] = op & 0xff;
+		out[1] = op >> 8;
+		out += 2;
+		in += 2;
+	}
+}
+
+#ifdef PIXELS_X86
+#if defined(__SSE2__)
+static inline __m128i scaleComponentSSE2(__m128i v, __m128i max) {
+	__m128i x = _mm_add_epi16(_mm_mullo_epi16(v, max), _mm_set1_epi16(15));
+	return _mm_srli_epi16(_mm_mulhi_epu16(x, _mm_set1_epi16(kDivide31)), 3);
+}
+
+static void toRGB888xSSE2(char *out, const char *in, size_t count) {
+	const __m128i mask = _mm_set1_epi16(0x1f);
+	const __m128i max = _mm_set1_epi16(255);
+
+	for (; count >= 8; count -= 8, in += 16, out += 32) {
+		__m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+		__m128i r = scaleComponentSSE2(_mm_and_si128(p, mask), max);
+		__m128i g = scaleComponentSSE2(_mm_and_si128(_mm_srli_epi16(p, 5), mask), max);
+		__m128i b = scaleComponentSSE2(_mm_and_si128(_mm_srli_epi16(p, 10), mask), max);
+		// low and high halves of each 32 bit pixel
+		__m128i gb = _mm_or_si128(_mm_slli_epi16(g, 8), b);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out),
+		                 _mm_unpacklo_epi16(gb, r));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + 16),
+		                 _mm_unpackhi_epi16(gb, r));
+	}
+	toRGB888xScalar(out, in, count);
+}
+
+static void toRGB565SSE2(char *out, const char *in, size_t count) {
+	const __m128i mask = _mm_set1_epi16(0x1f);
+	const __m128i max = _mm_set1_epi16(63);
+
+	for (; count >= 8; count -= 8, in += 16, out += 16) {
+		__m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+		__m128i r = _mm_slli_epi16(_mm_and_si128(p, mask), 11);
+		__m128i g = scaleComponentSSE2(_mm_and_si128(_mm_srli_epi16(p, 5), mask), max);
+		__m128i b = _mm_and_si128(_mm_srli_epi16(p, 10), mask);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out),
+		                 _mm_or_si128(_mm_or_si128(r, _mm_slli_epi16(g, 5)), b));
+	}
+	toRGB565Scalar(out, in, count);
+}
+#endif
+
+__attribute__((target("avx2")))
+static inline __m256i scaleComponentAVX2(__m256i v, __m256i max) {
+	__m256i x = _mm256_add_epi16(_mm256_mullo_epi16(v, max), _mm256_set1_epi16(15));
+	return _mm256_srli_epi16(_mm256_mulhi_epu16(x, _mm256_set1_epi16(kDivide31)), 3);
+}
+
+__attribute__((target("avx2")))
+static void toRGB888xAVX2(char *out, const char *in, size_t count) {
+	const __m256i mask = _mm256_set1_epi16(0x1f);
+	const __m256i max = _mm256_set1_epi16(255);
+
+	for (; count >= 16; count -= 16, in += 32, out += 64) {
+		__m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in));
+		// unpack works within 128 bit lanes, so put pixels 0-3 and
+		// 4-7 in the low halves of the lanes and 8-15 in the high
+		p = _mm256_permute4x64_epi64(p, 0xd8);
+		__m256i r = scaleComponentAVX2(_mm256_and_si256(p, mask), max);
+		__m256i g = scaleComponentAVX2(_mm256_and_si256(_mm256_srli_epi16(p, 5), mask), max);
+		__m256i b = scaleComponentAVX2(_mm256_and_si256(_mm256_srli_epi16(p, 10), mask), max);
+		__m256i gb = _mm256_or_si256(_mm256_slli_epi16(g, 8), b);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(out),
+		                    _mm256_unpacklo_epi16(gb, r));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 32),
+		                    _mm256_unpackhi_epi16(gb, r));
+	}
+	toRGB888xScalar(out, in, count);
+}
+
+__attribute__((target("avx2")))
+static void toRGB565AVX2(char *out, const char *in, size_t count) {
+	const __m256i mask = _mm256_set1_epi16(0x1f);
+	const __m256i max = _mm256_set1_epi16(63);
+
+	for (; count >= 16; count -= 16, in += 32, out += 32) {
+		__m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in));
+		__m256i r = _mm256_slli_epi16(_mm256_and_si256(p, mask), 11);
+		__m256i g = scaleComponentAVX2(_mm256_and_si256(_mm256_srli_epi16(p, 5), mask), max);
+		__m256i b = _mm256_and_si256(_mm256_srli_epi16(p, 10), mask);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(out),
+		                    _mm256_or_si256(_mm256_or_si256(r, _mm256_slli_epi16(g, 5)), b));
+	}
+	toRGB565Scalar(out, in, count);
+}
+#endif
+
+#ifdef PIXELS_NEON
+static inline uint16x8_t scaleComponentNEON(uint16x8_t v, uint16_t max) {
+	uint16x8_t x = vmlaq_n_u16(vdupq_n_u16(15), v, max);
+	uint32x4_t lo = vmull_n_u16(vget_low_u16(x), kDivide31);
+	uint32x4_t hi = vmull_n_u16(vget_high_u16(x), kDivide31);
+	return vshrq_n_u16(vcombine_u16(vshrn_n_u32(lo, 16), vshrn_n_u32(hi, 16)), 3);
+}
+
+static void toRGB888xNEON(char *out, const char *in, size_t count) {
+	const uint16x8_t mask = vdupq_n_u16(0x1f);
+
+	for (; count >= 8; count -= 8, in += 16, out += 32) {
+		uint16x8_t p = vreinterpretq_u16_u8(
+			vld1q_u8(reinterpret_cast<const uint8_t*>(in)));
+		uint8x8x4_t px;
+		px.val[0] = vmovn_u16(scaleComponentNEON(vandq_u16(vshrq_n_u16(p, 10), mask), 255));
+		px.val[1] = vmovn_u16(scaleComponentNEON(vandq_u16(vshrq_n_u16(p, 5), mask), 255));
+		px.val[2] = vmovn_u16(scaleComponentNEON(vandq_u16(p, mask), 255));
+		px.val[3] = vdup_n_u8(0);
+		vst4_u8(reinterpret_cast<uint8_t*>(out), px);
+	}
+	toRGB888xScalar(out, in, count);
+}
+
+static void toRGB565NEON(char *out, const char *in, size_t count) {
+	const uint16x8_t mask = vdupq_n_u16(0x1f);
+
+	for (; count >= 8; count -= 8, in += 16, out += 16) {
+		uint16x8_t p = vreinterpretq_u16_u8(
+			vld1q_u8(reinterpret_cast<const uint8_t*>(in)));
+		uint16x8_t r = vshlq_n_u16(vandq_u16(p, mask), 11);
+		uint16x8_t g = scaleComponentNEON(vandq_u16(vshrq_n_u16(p, 5), mask), 63);
+		uint16x8_t b = vandq_u16(vshrq_n_u16(p, 10), mask);
+		vst1q_u8(reinterpret_cast<uint8_t*>(out),
+		         vreinterpretq_u8_u16(vorrq_u16(vorrq_u16(r, vshlq_n_u16(g, 5)), b)));
+	}
+	toRGB565Scalar(out, in, count);
+}
+#endif
+
+static const uint64_t kPrime1 = 11400714785074694791ULL;
+static const uint64_t kPrime2 = 14029467366897019727ULL;
+static const uint64_t kPrime3 = 1609587929392839161ULL;
+static const uint64_t kPrime4 = 9650029242287828579ULL;
+static const uint64_t kPrime5 = 2870177450012600261ULL;
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const char *p) {
+	uint64_t x;
+	memcpy(&x, p, sizeof(x));
+	return x;
+}
+
+static inline uint32_t read32(const char *p) {
+	uint32_t x;
+	memcpy(&x, p, sizeof(x));
+	return x;
+}
+
+static inline uint64_t hashRound(uint64_t acc, uint64_t input) {
+	acc += input * kPrime2;
+	acc = rotl64(acc, 31);
+	return acc * kPrime1;
+}
+
+static inline uint64_t hashMerge(uint64_t acc, uint64_t val) {
+	acc ^= hashRound(0, val);
+	return acc * kPrime1 + kPrime4;
+}
+
+uint64_t pixels_hash(const char *in, size_t len) {
+	const char *end = in + len;
+	uint64_t h;
+
+	if (len >= 32) {
+		uint64_t v1 = kPrime1 + kPrime2;
+		uint64_t v2 = kPrime2;
+		uint64_t v3 = 0;
+		uint64_t v4 = -kPrime1;
+		for (; in + 32 <= end; in += 32) {
+			v1 = hashRound(v1, read64(in));
+			v2 = hashRound(v2, read64(in + 8));
+			v3 = hashRound(v3, read64(in + 16));
+			v4 = hashRound(v4, read64(in + 24));
+		}
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+		h = hashMerge(h, v1);
+		h = hashMerge(h, v2);
+		h = hashMerge(h, v3);
+		h = hashMerge(h, v4);
+	}
+	else {
+		h = kPrime5;
+	}
+	h += len;
+
+	for (; in + 8 <= end; in += 8) {
+		h ^= hashRound(0, read64(in));
+		h = rotl64(h, 27) * kPrime1 + kPrime4;
+	}
+	if (in + 4 <= end) {
+		h ^= uint64_t(read32(in)) * kPrime1;
+		h = rotl64(h, 23) * kPrime2 + kPrime3;
+		in += 4;
+	}
+	for (; in < end; in++) {
+		h ^= uint8_t(*in) * kPrime5;
+		h = rotl64(h, 11) * kPrime1;
+	}
+
+	h ^= h >> 33;
+	h *= kPrime2;
+	h ^= h >> 29;
+	h *= kPrime3;
+	h ^= h >> 32;
+
+	return h ? h : 1;
+}
+
+void (*pixels_copy)(char *out, const char *in, size_t count) = copyPixelsScalar;
+void (*pixels_to_rgb888x)(char *out, const char *in, size_t count) = toRGB888xScalar;
+void (*pixels_to_rgb565)(char *out, const char *in, size_t count) = toRGB565Scalar;
+static const char *implementation = "scalar";
+
+void pixels_init() {
+#ifdef PIXELS_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		pixels_copy = copyPixelsAVX2;
+		pixels_to_rgb888x = toRGB888xAVX2;
+		pixels_to_rgb565 = toRGB565AVX2;
+		implementation = "avx2";
+		return;
+	}
+#if defined(__SSE2__)
+	pixels_copy = copyPixelsSSE2;
+	pixels_to_rgb888x = toRGB888xSSE2;
+	pixels_to_rgb565 = toRGB565SSE2;
+	implementation = "sse2";
+	return;
+#endif
+#endif
+
+#ifdef PIXELS_NEON
+	pixels_copy = copyPixelsNEON;
+	pixels_to_rgb888x = toRGB888xNEON;
+	pixels_to_rgb565 = toRGB565NEON;
+	implementation = "neon";
+	return;
+#endif
+}
+
+const char *pixels_implementation() {
+	return implementation;
+}
+
+size_t pixels_kernels(PixelKernels *out) {
+	size_t n = 0;
+	out[n++] = PixelKernels{"scalar", copyPixelsScalar,
+	                        toRGB888xScalar, toRGB565Scalar};
+#ifdef PIXELS_X86
+#if defined(__SSE2__)
+	out[n++] = PixelKernels{"sse2", copyPixelsSSE2,
+	                        toRGB888xSSE2, toRGB565SSE2};
+#endif
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		out[n++] = PixelKernels{"avx2", copyPixelsAVX2,
+		                        toRGB888xAVX2, toRGB565AVX2};
+	}
+#endif
+#ifdef PIXELS_NEON
+	out[n++] = PixelKernels{"neon", copyPixelsNEON,
+	                        toRGB888xNEON, toRGB565NEON};
+#endif
+	return n;
+}
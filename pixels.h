@@ -0,0 +1,37 @@
+#ifndef PIXELS_H
+#define PIXELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Converts count pixels from the ATEN's RGB555 to the BGR555 used by
+// the rfb screen. Both buffers are little endian and need not be
+// aligned. Only valid after pixels_init.
+extern void (*pixels_copy)(char *out, const char *in, size_t count);
+
+// Convert count pixels of the screen's BGR555 to the common client
+// formats, 32 bit little endian RGB888 with an unused top byte, and
+// 16 bit little endian RGB565, giving the same result as
+// libvncserver's own translation.
+extern void (*pixels_to_rgb888x)(char *out, const char *in, size_t count);
+extern void (*pixels_to_rgb565)(char *out, const char *in, size_t count);
+
+// 64 bit content hash (xxHash64) of raw pixel data, used to recognise
+// tiles that have been resent unchanged. Never returns 0, so callers
+// may use 0 as "unknown".
+uint64_t pixels_hash(const char *in, size_t len);
+
+void pixels_init();
+const char *pixels_implementation();
+
+// For tests, the kernels built in that this CPU can run, the scalar
+// reference first. Fills out, which must hold 4, and returns how many.
+struct PixelKernels {
+	const char *name;
+	void (*copy)(char *out, const char *in, size_t count);
+	void (*toRGB888x)(char *out, const char *in, size_t count);
+	void (*toRGB565)(char *out, const char *in, size_t count);
+};
+size_t pixels_kernels(PixelKernels *out);
+
+#endif
@@ -0,0 +1,54 @@
+// -*- c++ -*-
+#ifndef _SPSC_RING_H_
+#define _SPSC_RING_H_
+
+#include <stddef.h>
+
+#include <atomic>
+
+// Bounded lock-free queue for exactly one producer thread and one
+// consumer thread. Neither side blocks or allocates; push fails when
+// the ring is full.
+template <typename T, size_t N>
+class SPSCRing {
+	static_assert(N && (N & (N - 1)) == 0, "ring size must be a power of two");
+
+	// Each index gets its own cache line. Padding rather than
+	// alignas, so rings can live in heap allocated objects.
+	struct PaddedIndex {
+		char padding[64];
+		std::atomic<size_t> value;
+
+		PaddedIndex() : value(0) {}
+	};
+
+	T mItems[N];
+	PaddedIndex mHead; // written by the consumer only
+	PaddedIndex mTail; // written by the producer only
+
+public:
+	bool push(const T& x) {
+		size_t tail = mTail.value.load(std::memory_order_relaxed);
+		if (tail - mHead.value.load(std::memory_order_acquire) == N)
+			return false;
+		mItems[tail & (N - 1)] = x;
+		mTail.value.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool pop(T& x) {
+		size_t head = mHead.value.load(std::memory_order_relaxed);
+		if (head == mTail.value.load(std::memory_order_acquire))
+			return false;
+		x = mItems[head & (N - 1)];
+		mHead.value.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	size_t size() const {
+		return mTail.value.load(std::memory_order_acquire) -
+			mHead.value.load(std::memory_order_acquire);
+	}
+};
+
+#endif /* _SPSC_RING_H_ */
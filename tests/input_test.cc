@@ -0,0 +1,281 @@
+// Checks how queued input is encoded for the BMC: expiry, what is
+// released after an overflow, update requests and pointer merging.
+#include <stdio.h>
+#include <stdint.h>
+
+#include <arpa/inet.h>
+
+#include <string>
+#include <vector>
+
+#include "input.h"
+
+static int failures = 0;
+
+static const int64_t kSecond = 1000 * 1000 * 1000;
+
+// The messages of a batch: "04v" or "04^" for a key, "p1@10,20" for
+// the pointer with its buttons, "u1" for an update request with its
+// incremental flag.
+static std::string messages(const std::vector<char>& batch) {
+	std::string s;
+	size_t i = 0;
+	while (i < batch.size()) {
+		const uint8_t *m = reinterpret_cast<const uint8_t*>(batch.data() + i);
+		char message[32];
+		size_t len;
+		switch (m[0]) {
+		case 4:
+			snprintf(message, sizeof(message), "%02x%c",
+			         m[8], m[2] ? 'v' : '^');
+			len = 18;
+			break;
+		case 5:
+			snprintf(message, sizeof(message), "p%u@%u,%u",
+			         m[2], m[3] << 8 | m[4], m[5] << 8 | m[6]);
+			len = 18;
+			break;
+		case 3:
+			snprintf(message, sizeof(message), "u%u", m[1]);
+			len = 10;
+			break;
+		default:
+			snprintf(message, sizeof(message), "type%u", m[0]);
+			len = batch.size() - i;
+			break;
+		}
+		if (!s.empty())
+			s += " ";
+		s += message;
+		i += len;
+	}
+	return s;
+}
+
+static WriteAction key(int64_t time, rfbKeySym keysym, bool down) {
+	WriteAction a;
+	a.type = WriteAction::Key;
+	a.timestamp = time;
+	a.keyEvent = {down, keysym};
+	return a;
+}
+
+static WriteAction pointer(int64_t time, uint8_t buttons, uint16_t x, uint16_t y) {
+	WriteAction a;
+	a.type = WriteAction::Pointer;
+	a.timestamp = time;
+	a.pointerEvent = {buttons, x, y};
+	return a;
+}
+
+static WriteAction paste(int64_t time, const char *text) {
+	WriteAction a;
+	a.type = WriteAction::Paste;
+	a.timestamp = time;
+	a.paste.text = new std::string(text);
+	return a;
+}
+
+static void expect(const char *what, const std::string& got,
+                   const char *expected) {
+	if (got != expected) {
+		printf("FAIL %s: \"%s\", expected \"%s\"\n",
+		       what, got.c_str(), expected);
+		failures++;
+	}
+}
+
+static void expectCount(const char *what, unsigned got, unsigned expected) {
+	if (got != expected) {
+		printf("FAIL %s: %u, expected %u\n", what, got, expected);
+		failures++;
+	}
+}
+
+// Input older than the deadline is dropped, apart from releases.
+static void checkExpiry() {
+	KeyMapper keys;
+	PasteTyper typer;
+	InputBatcher input(keys, typer);
+	input.setDeadline(kSecond);
+
+	int64_t now = 10 * kSecond;
+	input.begin(now);
+	input.add(key(now, XK_a, true));
+	input.add(pointer(now, 1, 10, 10));
+	expect("fresh input", messages(input.finish(true)), "04v p1@10,10");
+
+	// a second later than the deadline
+	now += 2 * kSecond;
+	int64_t old = now - 3 * kSecond / 2;
+	input.begin(now);
+	input.add(key(old, XK_b, true));
+	input.add(key(old, XK_a, false));
+	input.add(pointer(old, 1, 20, 20));
+	// a stale press of another button only releases
+	input.add(pointer(old, 3, 30, 30));
+	input.add(paste(old, "typed late"));
+	input.add(pointer(old, 0, 40, 40));
+	input.add(key(now, XK_c, true));
+	expect("stale input", messages(input.finish(true)), "04^ p0@40,40 06v");
+	expectCount("expired", input.result().expired, 4);
+	if (typer.typing()) {
+		printf("FAIL stale paste typed\n");
+		failures++;
+	}
+
+	// no deadline
+	input.setDeadline(0);
+	input.begin(now);
+	input.add(key(0, XK_c, false));
+	input.add(paste(0, "x"));
+	expect("no deadline", messages(input.finish(true)), "06^");
+	expectCount("expired without a deadline", input.result().expired, 0);
+	if (!input.result().pasted || !typer.typing()) {
+		printf("FAIL paste without a deadline not taken\n");
+		failures++;
+	}
+}
+
+// After an overflow everything held is released.
+static void checkReleaseAll() {
+	KeyMapper keys;
+	PasteTyper typer;
+	InputBatcher input(keys, typer);
+
+	input.begin(0);
+	input.add(key(0, XK_Shift_L, true));
+	input.add(key(0, XK_A, true));
+	input.add(pointer(0, 5, 100, 200));
+	input.add(paste(0, "abc"));
+	expect("held input", messages(input.finish(true)), "e1v 04v p5@100,200");
+
+	input.begin(0);
+	input.releaseAll();
+	expect("release all", messages(input.finish(true)), "e1^ 04^ p0@100,200");
+	if (typer.typing()) {
+		printf("FAIL paste still typing after release all\n");
+		failures++;
+	}
+
+	// nothing is left to release
+	input.begin(0);
+	input.releaseAll();
+	expect("release all again", messages(input.finish(true)), "");
+
+	// merged motion not yet sent goes out released
+	input.begin(0);
+	input.add(pointer(0, 0, 300, 400));
+	input.releaseAll();
+	expect("release pending motion", messages(input.finish(true)), "p0@300,400");
+}
+
+// Update requests merge into one, which goes after the input.
+static void checkUpdateRequests() {
+	KeyMapper keys;
+	PasteTyper typer;
+	InputBatcher input(keys, typer);
+
+	input.requestUpdate(1);
+	input.requestUpdate(0);
+	input.requestUpdate(1);
+	input.begin(0);
+	input.add(key(0, XK_a, true));
+	input.add(pointer(0, 0, 1, 2));
+	expect("request after input", messages(input.finish(true)), "04v p0@1,2 u0");
+	if (!input.result().updateRequested || input.updatePending()) {
+		printf("FAIL update request not taken\n");
+		failures++;
+	}
+
+	// held back while the session is set up
+	input.requestUpdate(1);
+	input.begin(0);
+	expect("request held", messages(input.finish(false)), "");
+	input.requestUpdate(1);
+	input.begin(0);
+	expect("incremental request", messages(input.finish(true)), "u1");
+
+	input.requestUpdate(0);
+	input.reset();
+	input.begin(0);
+	expect("request after reset", messages(input.finish(true)), "");
+}
+
+// Motion is merged, button changes go out at their own position, and
+// motion queued before a key goes first.
+static void checkPointer() {
+	KeyMapper keys;
+	PasteTyper typer;
+	InputBatcher input(keys, typer);
+
+	input.begin(0);
+	input.add(pointer(0, 0, 1, 1));
+	input.add(pointer(0, 0, 2, 2));
+	input.add(pointer(0, 0, 3, 3));
+	expect("merged motion", messages(input.finish(true)), "p0@3,3");
+	expectCount("merged", input.result().merged, 2);
+
+	// a click in the middle of motion splits it
+	input.begin(0);
+	input.add(pointer(0, 0, 10, 10));
+	input.add(pointer(0, 0, 15, 15));
+	input.add(pointer(0, 1, 20, 20));
+	input.add(pointer(0, 1, 25, 25));
+	input.add(pointer(0, 1, 30, 30));
+	input.add(pointer(0, 0, 40, 40));
+	input.add(pointer(0, 0, 50, 50));
+	expect("click during motion", messages(input.finish(true)),
+	       "p0@15,15 p1@20,20 p1@30,30 p0@40,40 p0@50,50");
+	expectCount("merged around a click", input.result().merged, 2);
+
+	// a double click is sent whole
+	input.begin(0);
+	input.add(pointer(0, 1, 50, 50));
+	input.add(pointer(0, 0, 50, 50));
+	input.add(pointer(0, 1, 50, 50));
+	input.add(pointer(0, 0, 50, 50));
+	expect("double click", messages(input.finish(true)),
+	       "p1@50,50 p0@50,50 p1@50,50 p0@50,50");
+
+	// shift-click keeps its order
+	input.begin(0);
+	input.add(pointer(0, 0, 60, 60));
+	input.add(key(0, XK_Shift_L, true));
+	input.add(pointer(0, 0, 70, 70));
+	input.add(pointer(0, 1, 70, 70));
+	input.add(pointer(0, 0, 70, 70));
+	input.add(key(0, XK_Shift_L, false));
+	input.add(pointer(0, 0, 80, 80));
+	expect("shift-click", messages(input.finish(true)),
+	       "p0@60,60 e1v p0@70,70 p1@70,70 p0@70,70 e1^ p0@80,80");
+	expectCount("merged with shift-click", input.result().merged, 0);
+	if (!input.result().input) {
+		printf("FAIL pointer input not reported\n");
+		failures++;
+	}
+
+	// motion waits for the end of the batch, before the update request
+	input.requestUpdate(1);
+	input.begin(0);
+	input.add(pointer(0, 0, 90, 90));
+	input.add(key(0, XK_a, true));
+	input.add(key(0, XK_a, false));
+	input.add(pointer(0, 0, 95, 95));
+	expect("motion at the end", messages(input.finish(true)),
+	       "p0@90,90 04v 04^ p0@95,95 u1");
+}
+
+int main() {
+	checkExpiry();
+	checkReleaseAll();
+	checkUpdateRequests();
+	checkPointer();
+
+	if (failures) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+	printf("input is batched as expected\n");
+	return 0;
+}
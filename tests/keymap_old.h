@@ -0,0 +1,15 @@
+// -*- c++ -*-
+#ifndef _KEYMAP_OLD_H_
+#define _KEYMAP_OLD_H_
+
+#include <stdint.h>
+
+#include <rfb/rfb.h>
+#include <rfb/keysym.h>
+
+// The sorted table and bsearch lookup keymap.cc used before its
+// tables were expanded at compile time.
+void keymap_old_init();
+uint8_t keymap_old_usageForKeysym(rfbKeySym c);
+
+#endif /* _KEYMAP_OLD_H_ */
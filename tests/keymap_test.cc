@@ -0,0 +1,152 @@
+// Checks the keymap against the table and lookup it replaced, for
+// every keysym, and the key sequences sent for modifiers the client
+// holds.
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "keymap.h"
+#include "keymap_old.h"
+
+static int failures = 0;
+
+// added to the US layout after the old table
+static bool addedKeysym(rfbKeySym keysym) {
+	return keysym == XK_plus || keysym == XK_braceleft ||
+		keysym == XK_braceright;
+}
+
+static void compareUsage(const KeyMapper& mapper, rfbKeySym keysym) {
+	uint8_t expected = addedKeysym(keysym) ? mapper.usage(keysym) :
+		keymap_old_usageForKeysym(keysym);
+	uint8_t got = mapper.usage(keysym);
+	if (got != expected) {
+		if (failures++ < 20)
+			printf("FAIL keysym %#x: usage %#x, expected %#x\n",
+			       keysym, got, expected);
+	}
+}
+
+// The presses for one key event, as usage and v for down or ^ for
+// up, e.g. "e1v 1fv e1^".
+static std::string keyEvent(KeyMapper& mapper, rfbKeySym keysym, bool down) {
+	std::vector<KeyPress> presses;
+	mapper.keyEvent(keysym, down, presses);
+	std::string s;
+	for (const KeyPress& p : presses) {
+		char press[8];
+		snprintf(press, sizeof(press), "%s%02x%c", s.empty() ? "" : " ",
+		         p.usage, p.down ? 'v' : '^');
+		s += press;
+	}
+	return s;
+}
+
+static void expectKeys(KeyMapper& mapper, const char *what, rfbKeySym keysym,
+                       bool down, const char *expected) {
+	std::string got = keyEvent(mapper, keysym, down);
+	if (got != expected) {
+		printf("FAIL %s: \"%s\", expected \"%s\"\n",
+		       what, got.c_str(), expected);
+		failures++;
+	}
+}
+
+static void checkSequences() {
+	KeyMapper us;
+	expectKeys(us, "a", XK_a, true, "04v");
+	expectKeys(us, "a", XK_a, false, "04^");
+	expectKeys(us, "@ without shift", XK_at, true, "e1v 1fv e1^");
+	expectKeys(us, "@ without shift", XK_at, false, "1f^");
+
+	expectKeys(us, "shift", XK_Shift_L, true, "e1v");
+	expectKeys(us, "shift+@", XK_at, true, "1fv");
+	expectKeys(us, "shift+@", XK_at, false, "1f^");
+	expectKeys(us, "shift+2", XK_2, true, "e1^ 1fv e1v");
+	expectKeys(us, "shift+2", XK_2, false, "1f^");
+	// the function keys keep the modifiers as held
+	expectKeys(us, "shift+tab", XK_Tab, true, "2bv");
+	expectKeys(us, "shift+tab", XK_Tab, false, "2b^");
+	expectKeys(us, "shift+right", XK_Right, true, "4fv");
+	expectKeys(us, "shift+right", XK_Right, false, "4f^");
+	expectKeys(us, "shift+space", XK_space, true, "2cv");
+	expectKeys(us, "shift+space", XK_space, false, "2c^");
+	// a release reported for another level's keysym
+	expectKeys(us, "shift+A", XK_A, true, "04v");
+	expectKeys(us, "shift up", XK_Shift_L, false, "e1^");
+	expectKeys(us, "a up after A", XK_a, false, "04^");
+
+	// right Alt is plain Alt on a US host
+	expectKeys(us, "right alt", XK_Alt_R, true, "e6v");
+	expectKeys(us, "right alt+F4", XK_F4, true, "3dv");
+	expectKeys(us, "right alt+F4", XK_F4, false, "3d^");
+	expectKeys(us, "right alt+a", XK_a, true, "04v");
+	expectKeys(us, "right alt+a", XK_a, false, "04^");
+	expectKeys(us, "right alt", XK_Alt_R, false, "e6^");
+
+	std::vector<KeyPress> presses;
+	us.keyEvent(XK_Control_L, true, presses);
+	us.keyEvent(XK_c, true, presses);
+	presses.clear();
+	us.releaseAll(presses);
+	if (presses.size() != 2) {
+		printf("FAIL releaseAll: %zu releases, expected 2\n", presses.size());
+		failures++;
+	}
+
+	// a layout with AltGr, where right Alt is AltGr
+	char path[] = "/tmp/keymap-test-XXXXXX";
+	int fd = mkstemp(path);
+	const char layout[] = "# de\ny 0x1d\nz 0x1c\n@ 0x14 altgr\n";
+	if (fd < 0 || write(fd, layout, sizeof(layout) - 1) < 0) {
+		perror(path);
+		exit(1);
+	}
+	close(fd);
+	KeyMapper de;
+	de.loadLayout(path);
+	unlink(path);
+	expectKeys(de, "de y", XK_y, true, "1dv");
+	expectKeys(de, "de y", XK_y, false, "1d^");
+	expectKeys(de, "de @", XK_at, true, "e6v 14v e6^");
+	expectKeys(de, "de @", XK_at, false, "14^");
+	expectKeys(de, "altgr", XK_Alt_R, true, "e6v");
+	expectKeys(de, "altgr+@", XK_at, true, "14v");
+	expectKeys(de, "altgr+@", XK_at, false, "14^");
+	expectKeys(de, "altgr+y", XK_y, true, "e6^ 1dv e6v");
+	expectKeys(de, "altgr+y", XK_y, false, "1d^");
+	expectKeys(de, "altgr+F4", XK_F4, true, "3dv");
+	expectKeys(de, "altgr+F4", XK_F4, false, "3d^");
+}
+
+int main() {
+	checkSequences();
+
+	keymap_old_init();
+	KeyMapper mapper;
+
+	// every keysym below 2^24 covers all the ranges in use, and
+	// beyond it a sample up to the top of the 32 bit range
+	for (rfbKeySym keysym = 0; keysym < (1 << 24); keysym++)
+		compareUsage(mapper, keysym);
+	for (uint64_t keysym = 1 << 24; keysym <= 0xffffffff; keysym += 4099)
+		compareUsage(mapper, keysym);
+	compareUsage(mapper, 0xffffffff);
+
+	for (rfbKeySym keysym : {XK_plus, XK_braceleft, XK_braceright}) {
+		if (!mapper.usage(keysym)) {
+			printf("FAIL keysym %#x: not mapped\n", keysym);
+			failures++;
+		}
+	}
+
+	if (failures) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+	printf("keymap matches the old table and sends the expected keys\n");
+	return 0;
+}
@@ -0,0 +1,210 @@
+// Types pastes into a Connection over a socketpair, as the proxy does
+// on the upstream loop, and checks the key events the BMC end reads
+// and how fast they arrive.
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <ev.h>
+
+#include "connection.h"
+#include "paste.h"
+
+static int failures = 0;
+
+static const double kRate = 200; // characters per second
+
+struct Message {
+	double time; // seconds since the first message
+	uint8_t type;
+	bool down;
+	uint32_t usage;
+};
+
+// Reads ATEN messages until the other end closes.
+static void readMessages(int fd, std::vector<Message>& messages) {
+	typedef std::chrono::steady_clock clock;
+	clock::time_point start;
+	char buf[18];
+	size_t len = 0;
+	for (;;) {
+		ssize_t n = read(fd, buf + len, sizeof(buf) - len);
+		if (n <= 0)
+			break;
+		len += n;
+		if (len < sizeof(buf))
+			continue;
+		len = 0;
+
+		clock::time_point now = clock::now();
+		if (messages.empty())
+			start = now;
+		Message m;
+		m.time = std::chrono::duration<double>(now - start).count();
+		m.type = buf[0];
+		m.down = buf[2];
+		uint32_t usage;
+		memcpy(&usage, buf + 5, sizeof(usage));
+		m.usage = ntohl(usage);
+		messages.push_back(m);
+	}
+}
+
+struct Typing {
+	ev_timer timer;
+	PasteTyper *typer;
+	KeyMapper *mapper;
+	Connection *connection;
+};
+
+static void typeTimeout(EV_P_ ev_timer *w, int) {
+	Typing *t = reinterpret_cast<Typing*>(w);
+	std::vector<char> batch;
+	t->typer->typeBatch(*t->mapper, batch);
+	t->connection->writeBytes(batch.data(), batch.size());
+	if (!t->connection->flush()) {
+		printf("FAIL socketpair full\n");
+		failures++;
+	}
+	if (!t->typer->typing())
+		ev_timer_stop(EV_A_ w);
+}
+
+// Pastes text at kRate and returns what the BMC end read.
+static std::vector<Message> paste(const std::string& text) {
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+		err(1, "socketpair");
+	unique_fd bmc(fds[1]);
+
+	std::vector<Message> messages;
+	std::thread reader(readMessages, int(bmc), std::ref(messages));
+	{
+		Connection connection((unique_fd(fds[0])));
+		KeyMapper mapper;
+		PasteTyper typer;
+		typer.setRate(kRate);
+		if (!typer.add(text)) {
+			printf("FAIL paste of %zu characters refused\n", text.size());
+			failures++;
+		}
+
+		struct ev_loop *loop = ev_loop_new(EVFLAG_AUTO);
+		Typing t;
+		t.typer = &typer;
+		t.mapper = &mapper;
+		t.connection = &connection;
+		ev_timer_init(&t.timer, typeTimeout, 0., PasteTyper::kInterval);
+		ev_timer_start(loop, &t.timer);
+		ev_run(loop, 0);
+		ev_loop_destroy(loop);
+	}
+	reader.join();
+	return messages;
+}
+
+// The key events, as usage and v for down or ^ for up.
+static std::string keys(const std::vector<Message>& messages) {
+	std::string s;
+	for (const Message& m : messages) {
+		char key[16];
+		if (m.type != 4)
+			snprintf(key, sizeof(key), "%stype%u", s.empty() ? "" : " ", m.type);
+		else
+			snprintf(key, sizeof(key), "%s%02x%c", s.empty() ? "" : " ",
+			         m.usage, m.down ? 'v' : '^');
+		s += key;
+	}
+	return s;
+}
+
+static void checkSequence() {
+	// shifted and unshifted characters, CRLF typed as one Return, and
+	// other control characters skipped
+	std::vector<Message> messages = paste("Ab@1\r\n\t\x01x\n");
+	std::string got = keys(messages);
+	const char *expected =
+		"e1v 04v e1^ 04^ 05v 05^ e1v 1fv e1^ 1f^ 1ev 1e^ "
+		"28v 28^ 2bv 2b^ 1bv 1b^ 28v 28^";
+	if (got != expected) {
+		printf("FAIL sequence: \"%s\", expected \"%s\"\n",
+		       got.c_str(), expected);
+		failures++;
+	}
+}
+
+static void checkPacing() {
+	const size_t len = 100;
+	std::string text;
+	for (size_t i = 0; i < len; i++)
+		text += 'a' + i % 26;
+	std::vector<Message> messages = paste(text);
+
+	// each character is a press and a release
+	if (messages.size() != 2 * len) {
+		printf("FAIL pacing: %zu messages, expected %zu\n",
+		       messages.size(), 2 * len);
+		failures++;
+		return;
+	}
+
+	// no more than the rate allows since the first batch, which is
+	// sent at once
+	const double batch = kRate * PasteTyper::kInterval;
+	size_t typed = 0;
+	for (const Message& m : messages) {
+		if (!m.down)
+			continue;
+		typed++;
+		if (typed > kRate * m.time + batch + 1) {
+			printf("FAIL pacing: %zu characters typed after %.3fs at %g/s\n",
+			       typed, m.time, kRate);
+			failures++;
+			return;
+		}
+	}
+
+	// nor much slower
+	double took = messages.back().time;
+	double expected = (len - batch) / kRate;
+	if (took > expected + 0.5) {
+		printf("FAIL pacing: %zu characters took %.3fs, expected %.3fs\n",
+		       len, took, expected);
+		failures++;
+	}
+}
+
+static void checkLimit() {
+	PasteTyper typer;
+	if (!typer.add(std::string(PasteTyper::kMaxLen, 'a')) ||
+	    typer.add("a")) {
+		printf("FAIL paste over %zu characters accepted\n",
+		       PasteTyper::kMaxLen);
+		failures++;
+	}
+	typer.clear();
+	if (typer.typing() || !typer.add("a")) {
+		printf("FAIL paste refused after clear\n");
+		failures++;
+	}
+}
+
+int main() {
+	checkSequence();
+	checkPacing();
+	checkLimit();
+
+	if (failures) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+	printf("pastes are typed as the expected keys at %g/s\n", kRate);
+	return 0;
+}
@@ -0,0 +1,86 @@
+// Checks that every pixel kernel this CPU can run gives the same
+// output as the scalar reference.
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+#include "pixels.h"
+
+typedef void (*Kernel)(char *out, const char *in, size_t count);
+
+static int failures = 0;
+
+// Runs both kernels over count pixels of in, with the input and
+// output offset by the given number of bytes from their allocation,
+// and compares the output and the bytes around it.
+static void compare(const char *name, const char *what, Kernel kernel,
+                    Kernel reference, size_t outSize, const char *in,
+                    size_t count, size_t inOffset, size_t outOffset) {
+	const size_t guard = 64;
+	std::vector<char> input(inOffset + 2 * count);
+	memcpy(input.data() + inOffset, in, 2 * count);
+	std::vector<char> expected(outOffset + outSize * count + guard, 0x5a);
+	std::vector<char> got(expected.size(), 0x5a);
+
+	reference(expected.data() + outOffset, input.data() + inOffset, count);
+	kernel(got.data() + outOffset, input.data() + inOffset, count);
+
+	if (got != expected) {
+		size_t i = 0;
+		while (got[i] == expected[i])
+			i++;
+		printf("FAIL %s %s: count %zu, offsets %zu/%zu, "
+		       "byte %zd is %02x, expected %02x\n",
+		       name, what, count, inOffset, outOffset,
+		       ssize_t(i) - ssize_t(outOffset),
+		       uint8_t(got[i]), uint8_t(expected[i]));
+		failures++;
+	}
+}
+
+static void check(const PixelKernels& k, const PixelKernels& ref,
+                  const char *in, size_t count, size_t inOffset,
+                  size_t outOffset) {
+	compare(k.name, "copy", k.copy, ref.copy, 2,
+	        in, count, inOffset, outOffset);
+	compare(k.name, "rgb888x", k.toRGB888x, ref.toRGB888x, 4,
+	        in, count, inOffset, outOffset);
+	compare(k.name, "rgb565", k.toRGB565, ref.toRGB565, 2,
+	        in, count, inOffset, outOffset);
+}
+
+int main() {
+	PixelKernels kernels[4];
+	size_t n = pixels_kernels(kernels);
+
+	// every 16 bit value, little endian
+	std::vector<char> all(2 * 65536);
+	for (size_t v = 0; v < 65536; v++) {
+		all[2 * v] = v & 0xff;
+		all[2 * v + 1] = v >> 8;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		const PixelKernels& k = kernels[i];
+		printf("%s\n", k.name);
+		check(k, kernels[0], all.data(), 65536, 0, 0);
+
+		// the vector loops' tails, and buffers that aren't aligned
+		for (size_t count = 0; count <= 70; count++) {
+			for (size_t offset = 0; offset < 32; offset++) {
+				const char *in = all.data() + 2 * (count * 977 % 60000);
+				check(k, kernels[0], in, count, offset, 0);
+				check(k, kernels[0], in, count, 0, offset);
+				check(k, kernels[0], in, count, offset, 31 - offset);
+			}
+		}
+	}
+
+	if (failures) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+	printf("all %zu kernels match\n", n);
+	return 0;
+}
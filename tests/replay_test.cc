@@ -0,0 +1,205 @@
+// Replays the first session of a capture through FrameDecoder and
+// checks the last screen against the one the BMC sent, given as its
+// raw RGB555 pixels.
+//
+//   replay-test capture expected
+#include <stdio.h>
+#include <string.h>
+
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <vector>
+
+#include "capture.h"
+#include "decoder.h"
+#include "pixels.h"
+
+static std::vector<char> readFile(const char *path) {
+	std::ifstream in{path, std::ios::binary};
+	if (!in)
+		throw std::runtime_error(std::string(path) + ": can't open");
+	return std::vector<char>{std::istreambuf_iterator<char>(in),
+	                         std::istreambuf_iterator<char>()};
+}
+
+// The bytes of the capture's first session, joined up. Like the
+// proxy's replay, a session may end with the file.
+static std::vector<char> readSession(const char *path) {
+	std::vector<char> file = readFile(path);
+	if (file.size() < sizeof(kCaptureMagic) ||
+	    memcmp(file.data(), kCaptureMagic, sizeof(kCaptureMagic)))
+		throw std::runtime_error(std::string(path) + ": not a capture");
+
+	std::vector<char> stream;
+	size_t at = sizeof(kCaptureMagic);
+	while (true) {
+		CaptureRecord r;
+		if (at == file.size())
+			return stream;
+		if (file.size() - at < sizeof(r))
+			throw std::runtime_error(std::string(path) + ": truncated");
+		memcpy(&r, file.data() + at, sizeof(r));
+		at += sizeof(r);
+		if (!r.len)
+			return stream;
+		if (file.size() - at < r.len)
+			throw std::runtime_error(std::string(path) + ": truncated");
+		stream.insert(stream.end(), file.data() + at, file.data() + at + r.len);
+		at += r.len;
+	}
+}
+
+// Reads the stream front to back, as the proxy's parser does.
+class Stream {
+	const std::vector<char>& mData;
+	size_t mAt;
+
+public:
+	explicit Stream(const std::vector<char>& data) : mData(data), mAt(0) {}
+
+	bool done() const {
+		return mAt == mData.size();
+	}
+
+	const char *take(size_t len) {
+		if (mData.size() - mAt < len)
+			throw std::runtime_error("capture ends inside a message");
+		const char *p = mData.data() + mAt;
+		mAt += len;
+		return p;
+	}
+
+	uint8_t u8() {
+		return uint8_t(*take(1));
+	}
+	uint16_t be16() {
+		const uint8_t *p = reinterpret_cast<const uint8_t*>(take(2));
+		return p[0] << 8 | p[1];
+	}
+	uint32_t be32() {
+		const uint8_t *p = reinterpret_cast<const uint8_t*>(take(4));
+		return uint32_t(p[0]) << 24 | p[1] << 16 | p[2] << 8 | p[3];
+	}
+};
+
+struct Screen {
+	int width = 0, height = 0;
+	std::vector<char> fb;
+	FrameDecoder decoder;
+	unsigned frames = 0, tiles = 0, fullFrames = 0;
+};
+
+static void readFrameUpdate(Stream& in, Screen& s) {
+	in.take(1); // padding
+	for (int rects = in.be16(); rects; rects--) {
+		// x, y, width, height, encoding, unknown, dataLen
+		in.take(4);
+		int width = in.be16();
+		int height = in.be16();
+		in.take(12);
+		if (width != s.width || height != s.height) {
+			s.width = width;
+			s.height = height;
+			s.fb.assign(2 * width * height, 0);
+			s.decoder.resize(width, height);
+		}
+
+		// type, padding, segments, totalLen
+		int type = in.u8();
+		in.take(1);
+		uint32_t segments = in.be32();
+		uint32_t totalLen = in.be32();
+		if (totalLen < 10)
+			throw std::runtime_error("bad update length");
+		size_t dataLen = totalLen - 10;
+		switch (type) {
+		case 0:
+			s.decoder.decodeTiles(s.fb.data(), in.take(segments * FrameDecoder::kTileLen),
+			                      segments);
+			if (s.decoder.haveDirtyTiles())
+				sraRgnDestroy(s.decoder.takeDirtyTiles());
+			s.tiles += segments;
+			break;
+		case 1:
+			s.decoder.decodeFrameData(s.fb.data(), 0, in.take(dataLen), dataLen);
+			s.decoder.invalidate();
+			s.fullFrames++;
+			break;
+		default:
+			in.take(dataLen);
+			break;
+		}
+	}
+	s.frames++;
+}
+
+static void replay(const std::vector<char>& stream, Screen& s) {
+	Stream in{stream};
+
+	// version, security types, challenge, auth result
+	in.take(12);
+	in.take(in.u8());
+	in.take(24);
+	in.take(4);
+	// ServerInit, with the name and 12 unknown bytes
+	in.take(20);
+	in.take(in.be32());
+	in.take(12);
+
+	while (!in.done()) {
+		int type = in.u8();
+		switch (type) {
+		case 0: readFrameUpdate(in, s); break;
+		case 4: in.take(20); break;
+		case 0x16: in.take(1); break;
+		case 0x37: in.take(2); break;
+		case 0x39: in.take(264); break;
+		case 0x3c: in.take(8); break;
+		default: throw std::runtime_error("unknown message type");
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s capture expected\n", argv[0]);
+		return 2;
+	}
+	pixels_init();
+
+	Screen s;
+	std::vector<char> expected;
+	try {
+		replay(readSession(argv[1]), s);
+		expected = readFile(argv[2]);
+	}
+	catch (const std::runtime_error& e) {
+		printf("FAIL %s\n", e.what());
+		return 1;
+	}
+	printf("%dx%d, %u updates, %u tiles, %u entire frames\n",
+	       s.width, s.height, s.frames, s.tiles, s.fullFrames);
+
+	if (expected.size() != s.fb.size()) {
+		printf("FAIL screen is %zu bytes, expected %zu\n",
+		       s.fb.size(), expected.size());
+		return 1;
+	}
+	// the screen is BGR555, the BMC sends RGB555
+	int failures = 0;
+	for (size_t i = 0; i < expected.size() / 2; i++) {
+		uint16_t in = uint8_t(expected[2 * i]) | uint8_t(expected[2 * i + 1]) << 8;
+		uint16_t want = (in >> 10 & 0x1f) | (in & 0x3e0) | (in & 0x1f) << 10;
+		uint16_t got = uint8_t(s.fb[2 * i]) | uint8_t(s.fb[2 * i + 1]) << 8;
+		if (got != want && failures++ < 10)
+			printf("FAIL pixel %zu,%zu is %04x, expected %04x\n",
+			       i % s.width, i / s.width, got, want);
+	}
+	if (failures) {
+		printf("%d pixels wrong\n", failures);
+		return 1;
+	}
+	printf("ok\n");
+	return 0;
+}